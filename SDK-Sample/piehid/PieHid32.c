@@ -19,53 +19,193 @@
 #include <time.h>
 #include <stdio.h>
 #include <signal.h>
-
-#define BUFFER_LENGTH 5 /* number of reports in the buffer */
+#include <sched.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <linux/futex.h>
+
+#define WRITE_QUEUE_DEPTH 8 /* default; at most MAX_WRITE_QUEUE_DEPTH */
+#define BUFFER_LENGTH 4 /* default number of reports in the buffer (must be a power of two) */
 #define REPORT_SIZE 80   /* max size of a single report */
+#define CACHE_LINE_SIZE 64
+
+/* Handles are the slot's index in the low bits, and its generation
+   above, so that a handle outliving its device is told apart from one
+   to whatever has the slot now. */
+#define HANDLE_SLOT_BITS 16
+#define HANDLE_SLOT_MASK ((1 << HANDLE_SLOT_BITS) - 1)
+#define MAX_GENERATION 0x7FFF /* keeps handles positive */
+#define MAX_SLOTS (1 << HANDLE_SLOT_BITS)
+
+/* The registry grows a chunk of slots at a time. */
+#define SLOT_CHUNK_SIZE 256
+#define MAX_SLOT_CHUNKS (MAX_SLOTS / SLOT_CHUNK_SIZE)
+
+#define KEY_INDEX_SIZE 1024 /* buckets for finding a slot by key; power of two */
+
+/* States of the coalesced overflow report (pending_report). */
+#define PENDING_EMPTY 0
+#define PENDING_FULL  1
+#define PENDING_BUSY  2 /* being written or copied; wait for it */
+
+#define PEEK_NONE   0
+#define PEEK_COPY   UINT_MAX /* PeekData() handed out peek_copy, not a slot */
 
 struct report {
+	uint64_t timestamp; /* CLOCK_MONOTONIC ns when the transfer completed */
 	int length;
 	char buffer[REPORT_SIZE];
+	char mask[REPORT_SIZE]; /* buffer XOR the previous report received */
 };
 
 struct pie_device {
-	int handle;
+	int handle; /* generation << HANDLE_SLOT_BITS | slot index */
 	int pid; //patti
 	int interfacenumber; //patti
 
 	/* HIDAPI objects */
 	hid_device *dev;
-	char *path;
+	/* Registry entry. key is the interface's path, which depends only
+	   on where it is plugged in; it is kept after the device goes so
+	   that the device gets the same slot, and handle, if it comes
+	   back. NULL for a slot never used. info, which the slot owns, is
+	   freed when the device goes unless in_use, which is set from
+	   SetupInterfaceEx2() until CloseInterface(). generation is bumped
+	   whenever the slot is given to a different interface, so that
+	   handles to the old one stop working. These are protected by
+	   registry_lock, and generation is also read without it. */
+	char *key;
+	struct pie_device *key_next; /* next in the same key_index bucket */
+	struct hid_device_info *info;
+	int present;
+	int in_use;
+	int seen; /* found by the current registry_rescan() */
+	atomic_uint generation;
 	
 	/* PieHid Configuration Options */
 	int suppress_duplicate_reports;
 	int disable_data_callback;
+	unsigned int buffer_length; /* power of two */
+	int overflow_policy; /* EOverflowPI */
 	
 	/* Thread Objects and data */
-	pthread_t read_thread;
 	pthread_t callback_thread;
-	pthread_mutex_t mutex;
-	pthread_cond_t cond;
 	volatile int shutdown;
-	
-	/* Data Ring Buffer */
+	atomic_int disconnected; /* set by input_report() when the device goes */
+	atomic_int closing; /* CloseInterface() has begun */
+	
+	/* Data Ring Buffer. input_report() is the only producer. The
+	   positions are free-running counters which are reduced modulo
+	   buffer_length only when indexing the buffer, so the buffer is
+	   empty when they are equal and full when they are buffer_length
+	   apart. Readers claim a report by advancing front_of_buffer with
+	   a compare-and-swap, so no lock is shared with the producer. */
 	struct report *buffer;
-	int front_of_buffer; /* next report to give to the application */
-	int back_of_buffer;  /* points to one slot after the last report read from hardware */
-
-	/* The last report received */
+	_Alignas(CACHE_LINE_SIZE)
+	atomic_uint back_of_buffer;  /* one past the last report read from hardware */
+	_Alignas(CACHE_LINE_SIZE)
+	atomic_uint front_of_buffer; /* next report to give to the application */
+
+	/* Readers with nothing to read sleep on wake_seq (a futex word).
+	   The producer only bumps it and makes the wake-up system call
+	   when waiters shows that somebody is actually asleep. */
+	_Alignas(CACHE_LINE_SIZE)
+	atomic_uint wake_seq;
+	atomic_int waiters;
+
+	/* eventfd handed out by GetReadEventFd(), or -1. The producer
+	   signals it when event_armed is set, which readers do when they
+	   find the ring empty, so it fires once per empty to non-empty
+	   transition. */
+	atomic_int event_fd;
+	atomic_int event_armed;
+
+	/* 1 + the index of the ring slot lent out by PeekData(), PEEK_COPY
+	   or PEEK_NONE. The producer must not write a lent slot, even
+	   though the report in it has already been consumed. */
+	atomic_uint peek_slot;
+	struct report peek_copy;
+
+	/* Reports lost (or merged, for piCoalesce) because the ring was full. */
+	atomic_uint overflow_count;
+
+	/* For piCoalesce, the newest report which did not fit in the ring.
+	   It is always newer than everything in the ring, so the read
+	   thread moves it into the ring before adding anything else, and
+	   readers only take it once the ring is empty. stash_pending()
+	   holds pending_seq odd while it writes pending_report, for
+	   ReadLast(), which copies it without taking it, as
+	   ReadCurrentState() does last_report. */
+	struct report pending_report;
+	atomic_int pending_state;
+	atomic_uint pending_seq;
+
+	/* The last report received, which is the device's current state.
+	   Only the producer writes it, bumping state_seq to odd before
+	   and back to even after, so readers can copy it without locking
+	   and retry if it changed underneath them. */
 	struct report last_report;
+	atomic_uint state_seq;
+
+	/* The length of the device's reports, from GetReadLength(), or -1
+	   if it isn't known. */
+	int read_length;
+
+	/* Writes queued by WriteDataAsync() which have not completed, and
+	   the error from one which failed, for the next call to report. */
+	int write_length;
+	unsigned int write_queue_depth;
+	atomic_uint writes_pending;
+	atomic_uint write_error;
+
+	/* Feature report requests which have not completed. */
+	atomic_uint features_pending;
 
 	/* Callbacks */
 	PHIDDataEvent data_event_callback;
+	PHIDDataEventEx data_event_callback_ex;
+	PHIDDataEventDelta data_event_callback_delta;
 	PHIDErrorEvent error_event_callback;
+	PHIDWriteEvent write_event_callback;
+	PHIDFeatureEvent feature_event_callback;
 };
 
-static struct pie_device pie_devices[MAX_XKEY_DEVICES];
-
-static int cond_timedwait(pthread_cond_t *cond, pthread_mutex_t *mutex, const struct timespec *abstime, const struct pie_device *pd);
-static int return_data(struct pie_device *pd, unsigned char *data);
-
+/* The registry of devices. Slot i is slot_chunks[i / SLOT_CHUNK_SIZE]
+   [i % SLOT_CHUNK_SIZE], NULL until an interface first needs it. A
+   chunk, and the entry in a slot, once allocated are never moved or
+   freed, so lookup_handle() reads them without locking; everything
+   else about them is protected by registry_lock. Slots below num_slots
+   have been handed out since the registry was last emptied, and ones
+   above it may be allocated from before that, to be handed out again.
+   Only slots with a key are in key_index.
+
+   Entries are added and removed one at a time as devices come and go:
+   by hotplug events where the platform has them, otherwise by each
+   EnumeratePIE() rescanning the bus. Either way a device which is
+   still there keeps its slot, and an open one is never disturbed, so
+   EnumeratePIE() is only a snapshot of the registry. */
+static _Atomic(_Atomic(struct pie_device *) *) slot_chunks[MAX_SLOT_CHUNKS];
+static int num_slots;
+static struct pie_device *key_index[KEY_INDEX_SIZE];
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Whether hotplug events are keeping the registry up to date. Protected
+   by enumerate_lock, which serializes EnumeratePIE() and ShutdownPIE(). */
+static pthread_mutex_t enumerate_lock = PTHREAD_MUTEX_INITIALIZER;
+static int hotplug_active;
+
+/* Threads in WaitForAnyData() all sleep on any_data_seq, whichever
+   handles they are waiting for. Producers only bump it and wake them
+   when any_data_waiters shows somebody is asleep. */
+static atomic_uint any_data_seq;
+static atomic_int any_data_waiters;
+static atomic_uint any_data_start; /* spreads the scan start between calls */
+
+static int return_data(struct pie_device *pd, unsigned char *data, unsigned char *mask, uint64_t *timestamp);
 
 struct device_map_entry {
     unsigned short vid;
@@ -85,38 +225,380 @@ static bool get_usage(unsigned short vid, unsigned short pid,
 		      int *writelength);
 
 
-unsigned int PIE_HID_CALL EnumeratePIE(long VID, TEnumHIDInfo *info, long *count)
+/* The entry in slot i, or NULL if it hasn't been allocated. */
+static struct pie_device *slot_entry(unsigned long i)
+{
+	_Atomic(struct pie_device *) *chunk;
+
+	chunk = atomic_load_explicit(&slot_chunks[i / SLOT_CHUNK_SIZE], memory_order_acquire);
+	if (!chunk)
+		return NULL;
+
+	return atomic_load_explicit(&chunk[i % SLOT_CHUNK_SIZE], memory_order_acquire);
+}
+
+/* Clear whatever a previous interface left in a slot, keeping its
+   generation. The slot must not be in use. */
+static void reset_slot(struct pie_device *pd)
+{
+	unsigned int generation = atomic_load(&pd->generation);
+	int handle = pd->handle;
+
+	memset(pd, 0, sizeof(*pd));
+	pd->handle = handle;
+	atomic_init(&pd->event_fd, -1);
+	atomic_init(&pd->generation, generation);
+}
+
+/* The entry for the next slot to be handed out, allocating it (and its
+   chunk) if it never has been, or NULL if there are no more slots or
+   no memory. Called with registry_lock held. */
+static struct pie_device *new_slot(void)
+{
+	_Atomic(struct pie_device *) *chunk;
+	struct pie_device *pd;
+	int i = num_slots;
+
+	if (i == MAX_SLOTS)
+		return NULL;
+
+	pd = slot_entry(i);
+	if (!pd) {
+		chunk = atomic_load(&slot_chunks[i / SLOT_CHUNK_SIZE]);
+		if (!chunk) {
+			chunk = calloc(SLOT_CHUNK_SIZE, sizeof(*chunk));
+			if (!chunk)
+				return NULL;
+			atomic_store_explicit(&slot_chunks[i / SLOT_CHUNK_SIZE], chunk, memory_order_release);
+		}
+
+		/* Its size is a multiple of CACHE_LINE_SIZE, as some of
+		   it is aligned to that. */
+		pd = aligned_alloc(CACHE_LINE_SIZE, sizeof(struct pie_device));
+		if (!pd)
+			return NULL;
+		atomic_init(&pd->generation, 0);
+		pd->handle = i;
+		reset_slot(pd);
+		atomic_store_explicit(&chunk[i % SLOT_CHUNK_SIZE], pd, memory_order_release);
+	}
+
+	num_slots++;
+	return pd;
+}
+
+/* Find the slot for a handle, or NULL if it isn't one or is stale. */
+static struct pie_device *lookup_handle(long hnd)
 {
-	struct hid_device_info *cur;
-	struct hid_device_info *hi;
+	unsigned long slot = (unsigned long)hnd & HANDLE_SLOT_MASK;
+	unsigned int generation = (unsigned long)hnd >> HANDLE_SLOT_BITS;
+
+	if (hnd < 0 || hnd > INT_MAX || generation == 0)
+		return NULL;
+
+	struct pie_device *pd = slot_entry(slot);
+	if (!pd || atomic_load_explicit(&pd->generation, memory_order_acquire) != generation)
+		return NULL;
+
+	return pd;
+}
+
+/* Make every handle to a slot stale. Called with registry_lock held,
+   and the slot not in use. */
+static void bump_generation(struct pie_device *pd)
+{
+	unsigned int generation = atomic_load(&pd->generation) % MAX_GENERATION + 1;
+
+	atomic_store_explicit(&pd->generation, generation, memory_order_release);
+	pd->handle = generation << HANDLE_SLOT_BITS | (pd->handle & HANDLE_SLOT_MASK);
+}
+
+static struct pie_device **key_bucket(const char *key)
+{
+	unsigned int hash = 5381;
+
+	while (*key)
+		hash = hash * 33 + (unsigned char)*key++;
+
+	return &key_index[hash & (KEY_INDEX_SIZE-1)];
+}
+
+/* Give a slot a key, or take it away if key is NULL. Called with
+   registry_lock held. */
+static void set_key(struct pie_device *pd, char *key)
+{
+	struct pie_device **p;
+
+	if (pd->key) {
+		for (p = key_bucket(pd->key); *p != pd; p = &(*p)->key_next)
+			;
+		*p = pd->key_next;
+		free(pd->key);
+	}
+	pd->key = key;
+	pd->key_next = NULL;
+	if (key) {
+		p = key_bucket(key);
+		pd->key_next = *p;
+		*p = pd;
+	}
+}
+
+/* Free a slot's entry, leaving its key. Called with registry_lock
+   held. */
+static void free_entry(struct pie_device *pd)
+{
+	pd->info->next = NULL;
+	hid_free_enumeration(pd->info);
+	pd->info = NULL;
+	pd->present = 0;
+}
+
+/* Put an interface in the registry, which takes ownership of info.
+   Returns its slot, or NULL if it wasn't wanted or there was no room.
+   Called with registry_lock held. */
+static struct pie_device *registry_add(struct hid_device_info *info)
+{
+	struct pie_device *pd;
 	int i;
 
-	/* Clear out the devices array */
-	for (i = 0; i < MAX_XKEY_DEVICES; i++) {
-		struct pie_device *pd = &pie_devices[i];
-		if (pd->dev) {
-			CloseInterface(i);
-			hid_close(pd->dev);
+	info->next = NULL;
+	if (info->vendor_id != PI_VID)
+		goto drop;
+
+	/* An interface coming back, or seen again, keeps its slot. The
+	   path only says where it is plugged in, so the product must
+	   match too. */
+	for (pd = *key_bucket(info->path); pd; pd = pd->key_next) {
+		if (strcmp(pd->key, info->path) == 0 &&
+		    pd->pid == info->product_id)
+			break;
+	}
+	if (pd) {
+		if (pd->present && pd->info->device == info->device) {
+			hid_free_enumeration(info);
+			return pd;
+		}
+
+		/* Unplugged and plugged back in since it was last seen,
+		   which a rescan can miss. The entry refers to a device
+		   which no longer exists, so it is replaced, or if it is
+		   open marked gone, for the next rescan after it is
+		   closed to replace. */
+		if (pd->present && pd->in_use) {
+			pd->present = 0;
+			hid_free_enumeration(info);
+			return pd;
 		}
-		free(pd->path);		
+		if (pd->info)
+			free_entry(pd);
+		pd->info = info;
+		pd->present = 1;
+		return pd;
 	}
-	memset(&pie_devices, 0, sizeof(pie_devices));
-	for (i = 0; i < MAX_XKEY_DEVICES; i++) {
-		struct pie_device *pd = &pie_devices[i];
-		pd->handle = i;
+
+	/* Otherwise use a new slot, or once there are no more one whose
+	   interface has gone and isn't open. */
+	char *key = strdup(info->path);
+	if (!key)
+		goto drop;
+	pd = new_slot();
+	for (i = 0; !pd && i < num_slots; i++) {
+		struct pie_device *old = slot_entry(i);
+		if (!old->present && !old->in_use)
+			pd = old;
 	}
-	
-		
-	hi = hid_enumerate(0x0, 0x0);
+	if (!pd) {
+		free(key);
+		goto drop;
+	}
+	if (pd->info)
+		free_entry(pd);
+
+	bump_generation(pd);
+	set_key(pd, NULL);
+	reset_slot(pd);
+	set_key(pd, key);
+	pd->info = info;
+	pd->present = 1;
+	pd->pid = info->product_id; //patti
+	pd->interfacenumber = info->interface_number; //patti
+	return pd;
+
+drop:
+	hid_free_enumeration(info);
+	return NULL;
+}
+
+/* Take a device which has gone out of the registry. Its entry stays
+   while it is open, and CloseInterface() frees it. Called with
+   registry_lock held. */
+static void registry_remove(struct pie_device *pd)
+{
+	if (pd->in_use)
+		pd->present = 0;
+	else
+		free_entry(pd);
+}
+
+/* Called by hid-libusb on its event handling thread when a device is
+   plugged in or removed. */
+static void HID_API_CALL hotplug_event(int event, struct hid_device_info *devs, void *device, void *user_data)
+{
+	int i;
+
+	pthread_mutex_lock(&registry_lock);
+	if (event == HID_HOTPLUG_ARRIVED) {
+		while (devs) {
+			struct hid_device_info *next = devs->next;
+			registry_add(devs);
+			devs = next;
+		}
+	}
+	else {
+		for (i = 0; i < num_slots; i++) {
+			struct pie_device *pd = slot_entry(i);
+			if (pd->info && pd->present && pd->info->device == device)
+				registry_remove(pd);
+		}
+	}
+	pthread_mutex_unlock(&registry_lock);
+}
+
+/* Bring the registry up to date by enumerating the bus, for when there
+   are no hotplug events. */
+static void registry_rescan(void)
+{
+	struct hid_device_info *cur, *next;
+	struct pie_device *pd;
+	int i;
+
+	/* The strings aren't used; the table below has everything. Other
+	   vendors' devices are left alone altogether. */
+	cur = hid_enumerate_filtered(PI_VID, NULL, 0, HID_ENUMERATE_NO_STRINGS);
+
+	pthread_mutex_lock(&registry_lock);
+	for (i = 0; i < num_slots; i++)
+		slot_entry(i)->seen = 0;
+	for (; cur; cur = next) {
+		next = cur->next;
+		pd = registry_add(cur);
+		if (pd)
+			pd->seen = 1;
+	}
+	for (i = 0; i < num_slots; i++) {
+		pd = slot_entry(i);
+		if (pd->present && !pd->seen)
+			registry_remove(pd);
+	}
+	pthread_mutex_unlock(&registry_lock);
+}
+
+/* Give up a slot's claim on its entry, freeing it if the device has
+   gone. */
+static void release_entry(struct pie_device *pd)
+{
+	pthread_mutex_lock(&registry_lock);
+	pd->in_use = 0;
+	if (pd->info && !pd->present)
+		free_entry(pd);
+	pthread_mutex_unlock(&registry_lock);
+}
+
+/* Set up the library's USB context. EnumeratePIE() does this itself if
+   it hasn't been done, so calling this is only needed to find out
+   early whether it works. */
+unsigned int PIE_HID_CALL InitializePIE(void)
+{
+	if (hid_init() < 0)
+		return PIE_HID_INIT_FAILED;
+
+	return 0;
+}
+
+/* Close every open interface and free the USB context, so that nothing
+   of the library is left running in the process. EnumeratePIE() may be
+   called again afterwards. */
+void PIE_HID_CALL ShutdownPIE(void)
+{
+	int i, n;
+
+	pthread_mutex_lock(&enumerate_lock);
+	hid_hotplug_deregister();
+	hotplug_active = 0;
+
+	pthread_mutex_lock(&registry_lock);
+	n = num_slots;
+	pthread_mutex_unlock(&registry_lock);
+	for (i = 0; i < n; i++) {
+		struct pie_device *pd = slot_entry(i);
+		if (pd->dev)
+			CloseInterface(pd->handle);
+	}
+
+	/* The entries hold references into the USB context. Forgetting
+	   the keys too means every handle is stale afterwards. The slots
+	   themselves are kept, to be handed out again. */
+	pthread_mutex_lock(&registry_lock);
+	for (i = 0; i < num_slots; i++) {
+		struct pie_device *pd = slot_entry(i);
+		if (pd->info)
+			free_entry(pd);
+		if (pd->key) {
+			set_key(pd, NULL);
+			bump_generation(pd);
+		}
+	}
+	num_slots = 0;
+	pthread_mutex_unlock(&registry_lock);
+
+	hid_exit();
+	pthread_mutex_unlock(&enumerate_lock);
+}
+
+/* Fill info with up to MAX_XKEY_DEVICES interfaces, as older programs
+   expect; EnumeratePIEEx() has no limit. */
+unsigned int PIE_HID_CALL EnumeratePIE(long VID, TEnumHIDInfo *info, long *count)
+{
+	unsigned int res = EnumeratePIEEx(VID, info, MAX_XKEY_DEVICES, count);
+
+	if (res == PIE_HID_ENUMERATE_MORE_DATA) {
+		*count = MAX_XKEY_DEVICES;
+		res = 0;
+	}
+
+	return res;
+}
+
+/* Fill info with up to maxCount interfaces, and set count to how many
+   there are. If that is more than maxCount, PIE_HID_ENUMERATE_MORE_DATA
+   is returned and the call can be made again with a bigger array. */
+unsigned int PIE_HID_CALL EnumeratePIEEx(long VID, TEnumHIDInfo *info, long maxCount, long *count)
+{
+	int i;
+
+	/* Once hotplug events are coming the registry is always current;
+	   the devices already present are added by registering. */
+	pthread_mutex_lock(&enumerate_lock);
+	if (!hotplug_active) {
+		if (hid_hotplug_register(PI_VID, 0x0, hotplug_event, NULL) == 0)
+			hotplug_active = 1;
+		else
+			registry_rescan();
+	}
+	pthread_mutex_unlock(&enumerate_lock);
 	
 	*count = 0;
 
-	/* Pack the return data, and set up our pie_devices array. */
-	cur = hi;
-	while (cur && *count < MAX_XKEY_DEVICES) {
-		if (cur->vendor_id != PI_VID) {
-			printf("Continuing, vid: %hx pivid: %hx\n", cur->vendor_id, (unsigned short)PI_VID);
-			cur = cur->next;
+	/* Pack the return data from the registry. */
+	pthread_mutex_lock(&registry_lock);
+	for (i = 0; i < num_slots; i++) {
+		struct pie_device *pd = slot_entry(i);
+		const struct hid_device_info *cur = pd->info;
+		if (!cur || !pd->present)
+			continue;
+		if (*count >= maxCount) {
+			(*count)++;
 			continue;
 		}
 		
@@ -146,7 +628,7 @@ unsigned int PIE_HID_CALL EnumeratePIE(long VID, TEnumHIDInfo *info, long *count
 		inf->writeSize = writelength; //36;
 		strncpy(inf->DevicePath, cur->path, sizeof(inf->DevicePath));
 		inf->DevicePath[sizeof(inf->DevicePath)-1] = '\0';
-		inf->Handle = *count;
+		inf->Handle = pd->handle;
 		inf->Version = cur->release_number;
 		inf->ManufacturerString[0] = '\0';
 		inf->ProductString[0] = '\0';
@@ -159,13 +641,12 @@ unsigned int PIE_HID_CALL EnumeratePIE(long VID, TEnumHIDInfo *info, long *count
 		GetProductString(inf->PID, inf->ProductString);
 		inf->ProductString[128-1] = '\0';
 
-		struct pie_device *pd = &pie_devices[*count];
-		pd->path = cur->path;
-		pd->pid = cur->product_id; //patti
-		pd->interfacenumber = cur->interface_number; //patti
 		(*count)++;
-		cur = cur->next;
 	}
+	pthread_mutex_unlock(&registry_lock);
+
+	if (*count > maxCount)
+		return PIE_HID_ENUMERATE_MORE_DATA;
 
 	return 0;
 }
@@ -177,10 +658,11 @@ unsigned int PIE_HID_CALL GetXKeyVersion(long hnd)
 }
 
 
-/* Make a timespec for the specified number of milliseconds in the future. */
+/* Make a timespec for the specified number of milliseconds in the future,
+   measured on CLOCK_MONOTONIC. */
 static void make_timeout(struct timespec *ts, int milliseconds)
 {
-	clock_gettime(CLOCK_REALTIME, ts);
+	clock_gettime(CLOCK_MONOTONIC, ts);
 	ts->tv_sec += milliseconds / 1000;
 	ts->tv_nsec += (milliseconds % 1000) * 1000000; //convert to ns
 	if (ts->tv_nsec >= 1000000000L) {
@@ -189,262 +671,577 @@ static void make_timeout(struct timespec *ts, int milliseconds)
 	}
 }
 
-static void cleanup_mutex(void *param)
+/* Convert an absolute CLOCK_MONOTONIC deadline into the time remaining
+   until it. Returns 0 if the deadline has already passed. */
+static int time_remaining(const struct timespec *deadline, struct timespec *ts)
 {
-	struct pie_device *pd = param;
-	pthread_mutex_unlock(&pd->mutex);
+	clock_gettime(CLOCK_MONOTONIC, ts);
+	ts->tv_sec = deadline->tv_sec - ts->tv_sec;
+	ts->tv_nsec = deadline->tv_nsec - ts->tv_nsec;
+	if (ts->tv_nsec < 0) {
+		ts->tv_nsec += 1000000000L;
+		ts->tv_sec -= 1;
+	}
+	return ts->tv_sec >= 0;
 }
 
-static void *read_thread(void *param)
+static void futex_wait(atomic_uint *addr, unsigned int val, const struct timespec *timeout)
 {
-	struct pie_device *pd = param;
-	char buf[80];
-	buf[0] = 0x0;
-	
+	syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, timeout, NULL, 0);
+}
+
+static void futex_wake(atomic_uint *addr)
+{
+	syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+/* Wake every reader sleeping on this device, whether or not the ring
+   has changed. Used for shutdown and for configuration changes. */
+static void wake_all_readers(struct pie_device *pd)
+{
+	atomic_fetch_add(&pd->wake_seq, 1);
+	futex_wake(&pd->wake_seq);
+}
+
+/* Wake every thread in WaitForAnyData(), if there are any. */
+static void wake_any_data_waiters(void)
+{
+	if (atomic_load(&any_data_waiters) > 0) {
+		atomic_fetch_add(&any_data_seq, 1);
+		futex_wake(&any_data_seq);
+	}
+}
+
+/* Called by the producer after publishing a report. The store to
+   back_of_buffer and the load of waiters are both sequentially
+   consistent, as are the increment of waiters and the re-check of the
+   ring in wait_for_data(), so either we see the sleeper here or the
+   sleeper sees the new report before it goes to sleep. The same goes
+   for any_data_waiters and WaitForAnyData(), and for event_armed and
+   rearm_event_fd(). */
+static void wake_readers(struct pie_device *pd)
+{
+	if (atomic_load(&pd->waiters) > 0)
+		wake_all_readers(pd);
+
+	wake_any_data_waiters();
+
+	if (atomic_load(&pd->event_armed) &&
+	    atomic_exchange(&pd->event_armed, 0)) {
+		uint64_t one = 1;
+		if (write(atomic_load(&pd->event_fd), &one, sizeof(one)) < 0) {
+			/* Counter saturated; it's readable anyway. */
+		}
+	}
+}
+
+/* Called by readers which found the ring empty. If the application is
+   watching the event fd, clear it and arm it to fire again on the next
+   report. Returns 1 if it did, in which case the caller must look at
+   the ring once more, as a report may have been added just before the
+   fd was armed. */
+static int rearm_event_fd(struct pie_device *pd)
+{
+	int fd = atomic_load(&pd->event_fd);
+	uint64_t value;
+
+	if (fd < 0 || atomic_load(&pd->event_armed))
+		return 0;
+
+	if (read(fd, &value, sizeof(value)) < 0) {
+		/* EAGAIN: it was already clear. */
+	}
+	atomic_store(&pd->event_armed, 1);
+
+	return 1;
+}
+
+static int buffer_is_empty(struct pie_device *pd)
+{
+	return atomic_load(&pd->front_of_buffer) ==
+	       atomic_load(&pd->back_of_buffer) &&
+	       atomic_load(&pd->pending_state) != PENDING_FULL;
+}
+
+static int callback_is_active(struct pie_device *pd)
+{
+	return (pd->data_event_callback || pd->data_event_callback_ex ||
+	        pd->data_event_callback_delta) &&
+	       !pd->disable_data_callback;
+}
+
+/* Sleep until there is data in the ring (and, for the callback thread,
+   a data callback to give it to), the device is shut down, or the
+   deadline passes. A NULL deadline waits forever. Returns 0 or
+   ETIMEDOUT. */
+static int wait_for_data(struct pie_device *pd, const struct timespec *deadline, int for_callback)
+{
+	int ret_val = 0;
+
+	atomic_fetch_add(&pd->waiters, 1);
 	while (!pd->shutdown) {
-		int res = hid_read(pd->dev, (unsigned char*)buf, sizeof(buf));
-		if (res > 0) {
-			int is_empty = 0;
-			int wake_up_waiters = 0;
-			int skip = 0;
-			
-			pthread_mutex_lock(&pd->mutex);
-			pthread_cleanup_push(&cleanup_mutex, pd)
-			
-			/* Check if this is the same as the last report
-			   received (ie: if it's a duplicate). */
-			if (res == pd->last_report.length &&
-			    memcmp(buf, pd->last_report.buffer, res) == 0)
-			{
-				if (pd->suppress_duplicate_reports)
-					skip = 1;
-			}
-			
-			if (!skip) {
-				/* See if this is going into an empty buffer */
-				if (pd->front_of_buffer == pd->back_of_buffer)
-					wake_up_waiters = 1;
-					
-				/* Put this report at the end of the buffer
-				   Add an extra byte at the beginning for the
-				   report number. */
-				int new_position = pd->back_of_buffer;
-				struct report *rpt = &pd->buffer[new_position];
-				memcpy(rpt->buffer+1, buf, res);
-				rpt->length = res+1;
-
-				/* Increment the back-of-buffer pointer, moving
-				   the front-of-buffer pointer if we've overflowed. */
-				new_position += 1;
-				new_position %= BUFFER_LENGTH;
-				if (new_position == pd->front_of_buffer) {
-					/* Buffer is full. Lose the first one, and
-					   consider the next one the front. */
-					pd->front_of_buffer++;
-					pd->front_of_buffer %= BUFFER_LENGTH;
-				}
-				pd->back_of_buffer = new_position;
-				
-				/* If the buffer was empty, wake up any waiting
-				   threads which may be waiting on data. */
-				if (wake_up_waiters) {
-					pthread_cond_signal(&pd->cond);
-				}
-				
-				/* Save this report as the last one received. */
-				memcpy(pd->last_report.buffer, buf, res);
-				pd->last_report.length = res;
-			}
+		unsigned int seq = atomic_load(&pd->wake_seq);
+		struct timespec ts;
+
+		if (!buffer_is_empty(pd) && (!for_callback || callback_is_active(pd)))
+			break;
 
-			pthread_mutex_unlock(&pd->mutex);
-			pthread_cleanup_pop(0);
-			
+		if (deadline && !time_remaining(deadline, &ts)) {
+			ret_val = ETIMEDOUT;
+			break;
 		}
-		else if (res < 0) {
-			/* An error occurred, possibly a device disconnect,
-			   or the handle was closed from a different thread.
-			   Break out of this loop and end this thread. */
-			
-			if (pd->error_event_callback) {
-				pd->error_event_callback(pd->handle, PIE_HID_READ_BAD_INTERFACE_HANDLE);
-			}
-			
-			/* Break out of this loop. */
-			pd->shutdown = 1;
+
+		/* Returns immediately if wake_seq has moved on since it was
+		   sampled above. Spurious wakeups just run the loop again. */
+		futex_wait(&pd->wake_seq, seq, deadline? &ts: NULL);
+	}
+	atomic_fetch_sub(&pd->waiters, 1);
+
+	return ret_val;
+}
+
+/* Claim the coalesced overflow report for the producer. Readers only
+   hold it for the length of a memcpy(), so just wait them out. Returns
+   the state it was in before being claimed. */
+static int claim_pending(struct pie_device *pd)
+{
+	int state = atomic_load(&pd->pending_state);
+
+	for (;;) {
+		if (state == PENDING_BUSY) {
+			sched_yield();
+			state = atomic_load(&pd->pending_state);
 		}
+		else if (atomic_compare_exchange_weak(&pd->pending_state, &state, PENDING_BUSY))
+			return state;
 	}
+}
 
-	/* Wake up anyone waiting on data. Do this under a mutex so that
-	   any thread which may be about to sleep will actually go to sleep
-	   before the broadcast is called here to wake them up. */
-	pthread_mutex_lock(&pd->mutex);
-	pthread_cond_broadcast(&pd->cond);
-	pthread_mutex_unlock(&pd->mutex);
-	
-	return NULL;
+/* Whether PeekData() has lent out the slot for position pos. Only the
+   producer calls this, after it has loaded front_of_buffer, which
+   PeekData() only advances after setting peek_slot. */
+static int slot_is_lent(struct pie_device *pd, unsigned int pos)
+{
+	return atomic_load(&pd->peek_slot) == (pos & (pd->buffer_length-1)) + 1;
+}
+
+/* Move the coalesced overflow report into the ring if there is room for
+   it now. Returns 0 if nothing is pending any more. Only the producer
+   calls this. */
+static int flush_pending(struct pie_device *pd)
+{
+	unsigned int back = atomic_load_explicit(&pd->back_of_buffer, memory_order_relaxed);
+
+	if (back - atomic_load_explicit(&pd->front_of_buffer, memory_order_acquire) >= pd->buffer_length ||
+	    slot_is_lent(pd, back))
+		return -1;
+
+	/* A reader may have taken it in the meantime. */
+	if (claim_pending(pd) == PENDING_EMPTY) {
+		atomic_store(&pd->pending_state, PENDING_EMPTY);
+		return 0;
+	}
+
+	pd->buffer[back & (pd->buffer_length-1)] = pd->pending_report;
+	atomic_store(&pd->back_of_buffer, back + 1);
+	atomic_store_explicit(&pd->pending_state, PENDING_EMPTY, memory_order_release);
+	wake_readers(pd);
+
+	return 0;
+}
+
+/* Keep a report which did not fit in the ring as the coalesced overflow
+   report, replacing any earlier one. Only the producer calls this. */
+static void stash_pending(struct pie_device *pd, const char *buf, const char *mask, int len, uint64_t timestamp)
+{
+	struct report *rpt = &pd->pending_report;
+	int i, old_length = 0;
+
+	if (claim_pending(pd) == PENDING_FULL)
+		old_length = rpt->length;
+
+	unsigned int seq = atomic_load_explicit(&pd->pending_seq, memory_order_relaxed);
+	atomic_store_explicit(&pd->pending_seq, seq + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	/* The report being replaced is never delivered, so its changes
+	   are carried over into the mask of the one replacing it. */
+	rpt->mask[0] = 0;
+	for (i = 1; i <= len; i++)
+		rpt->mask[i] = mask[i-1] | (i < old_length ? rpt->mask[i] : 0);
+
+	memcpy(rpt->buffer+1, buf, len);
+	rpt->length = len+1;
+	pd->pending_report.timestamp = timestamp;
+	atomic_store_explicit(&pd->pending_seq, seq + 2, memory_order_release);
+	atomic_store_explicit(&pd->pending_state, PENDING_FULL, memory_order_release);
+
+	/* Readers take it once the ring is empty, which it may be already,
+	   if the only free slot is lent out by PeekData(). */
+	wake_readers(pd);
+}
+
+/* Take the coalesced overflow report for a reader which found the ring
+   empty, copying at most max_length bytes of it, and its change mask and
+   timestamp for those which are not NULL. Returns the number of bytes
+   copied, -1 if there is none, or -2 if the ring has been refilled
+   since the caller found it empty, so the caller should look again. */
+static int take_pending(struct pie_device *pd, unsigned char *data, unsigned char *mask, int max_length, uint64_t *timestamp)
+{
+	int state = PENDING_FULL;
+
+	if (!atomic_compare_exchange_strong(&pd->pending_state, &state, PENDING_BUSY))
+		return -1;
+
+	/* The producer cannot add to the ring while this is busy, so if
+	   the ring is still empty nothing older can turn up. */
+	if (atomic_load(&pd->front_of_buffer) != atomic_load(&pd->back_of_buffer)) {
+		atomic_store_explicit(&pd->pending_state, PENDING_FULL, memory_order_release);
+		return -2;
+	}
+
+	int length = pd->pending_report.length;
+	if (length > max_length)
+		length = max_length;
+	memcpy(data, pd->pending_report.buffer, length);
+	if (mask)
+		memcpy(mask, pd->pending_report.mask, length);
+	if (timestamp)
+		*timestamp = pd->pending_report.timestamp;
+	atomic_store_explicit(&pd->pending_state, PENDING_EMPTY, memory_order_release);
+
+	return length;
+}
+
+/* Put a report at the end of the ring, or deal with it according to the
+   overflow policy if the ring is full. Only the producer calls this. */
+static void push_report(struct pie_device *pd, const char *buf, const char *mask, int len, uint64_t timestamp)
+{
+	/* A coalesced report is older than this one, so it goes first. */
+	if (atomic_load(&pd->pending_state) != PENDING_EMPTY &&
+	    flush_pending(pd) != 0) {
+		atomic_fetch_add(&pd->overflow_count, 1);
+		stash_pending(pd, buf, mask, len, timestamp);
+		return;
+	}
+
+	unsigned int back = atomic_load_explicit(&pd->back_of_buffer, memory_order_relaxed);
+	unsigned int front = atomic_load_explicit(&pd->front_of_buffer, memory_order_acquire);
+
+	while (back - front >= pd->buffer_length) {
+		atomic_fetch_add(&pd->overflow_count, 1);
+
+		if (pd->overflow_policy == piDropNewest)
+			return;
+		if (pd->overflow_policy == piCoalesce) {
+			stash_pending(pd, buf, mask, len, timestamp);
+			return;
+		}
+
+		/* Buffer is full. Lose the first one, and consider the next
+		   one the front. A reader may have consumed it in the
+		   meantime, in which case front is reloaded and there is
+		   room after all. */
+		if (atomic_compare_exchange_weak_explicit(&pd->front_of_buffer,
+		        &front, front + 1,
+		        memory_order_acq_rel, memory_order_acquire))
+			break;
+		atomic_fetch_sub(&pd->overflow_count, 1);
+	}
+
+	/* The slot may still be lent out by PeekData(), in which case
+	   there is nothing to drop to make room. */
+	if (slot_is_lent(pd, back)) {
+		atomic_fetch_add(&pd->overflow_count, 1);
+		if (pd->overflow_policy == piCoalesce)
+			stash_pending(pd, buf, mask, len, timestamp);
+		return;
+	}
+
+	/* Add an extra byte at the beginning for the report number. */
+	struct report *rpt = &pd->buffer[back & (pd->buffer_length-1)];
+	memcpy(rpt->buffer+1, buf, len);
+	rpt->mask[0] = 0;
+	memcpy(rpt->mask+1, mask, len);
+	rpt->length = len+1;
+	rpt->timestamp = timestamp;
+
+	atomic_store(&pd->back_of_buffer, back + 1);
+	wake_readers(pd);
+}
+
+/* Set mask to buf XOR the last report received, a word at a time,
+   treating bytes past the end of the last report as zero. Returns
+   nonzero if any bit differs. */
+static int change_mask(struct pie_device *pd, char *mask, const char *buf, int len)
+{
+	const char *last = pd->last_report.buffer;
+	int common = len < pd->last_report.length ? len : pd->last_report.length;
+	uint64_t changed = 0;
+	int i = 0;
+
+	for (; i + 8 <= common; i += 8) {
+		uint64_t a, b;
+		memcpy(&a, buf + i, 8);
+		memcpy(&b, last + i, 8);
+		a ^= b;
+		changed |= a;
+		memcpy(mask + i, &a, 8);
+	}
+	for (; i < common; i++) {
+		mask[i] = buf[i] ^ last[i];
+		changed |= (unsigned char)mask[i];
+	}
+	for (; i < len; i++) {
+		mask[i] = buf[i];
+		changed |= (unsigned char)mask[i];
+	}
+
+	return changed != 0;
+}
+
+/* Called by hid-libusb with each input report, straight from the USB
+   transfer completion on its event handling thread. This is the only
+   producer for the ring. A length of -1 means the device has gone. The
+   timestamp is when the transfer completed, in CLOCK_MONOTONIC ns. */
+static void HID_API_CALL input_report(hid_device *dev, const unsigned char *data, int length, uint64_t timestamp, void *user_data)
+{
+	struct pie_device *pd = user_data;
+	
+	if (length > 0) {
+		const char *buf = (const char*)data;
+		char mask[REPORT_SIZE-1];
+		if (length > REPORT_SIZE-1)
+			length = REPORT_SIZE-1;
+
+		/* Find which bits changed since the last report
+		   received, and so whether this is a duplicate. */
+		int changed = change_mask(pd, mask, buf, length);
+		if (length == pd->last_report.length && !changed &&
+		    pd->suppress_duplicate_reports)
+			return;
+
+		push_report(pd, buf, mask, length, timestamp);
+
+		/* Save this report as the last one received. */
+		unsigned int seq = atomic_load_explicit(&pd->state_seq, memory_order_relaxed);
+		atomic_store_explicit(&pd->state_seq, seq + 1, memory_order_relaxed);
+		atomic_thread_fence(memory_order_release);
+		memcpy(pd->last_report.buffer, buf, length);
+		pd->last_report.length = length;
+		atomic_store_explicit(&pd->state_seq, seq + 2, memory_order_release);
+	}
+	else if (length < 0) {
+		/* The device has been disconnected. The callback thread
+		   tells the application, as it may well close the interface
+		   from its error callback, which can't be done from here. */
+		atomic_store(&pd->disconnected, 1);
+		
+		/* Wake up anyone waiting on data so they can see the
+		   shutdown. */
+		pd->shutdown = 1;
+		wake_all_readers(pd);
+		wake_any_data_waiters();
+	}
 }
 
 static void *callback_thread(void *param)
 {
 	struct pie_device *pd = param;
-	char buf[80];
+	unsigned char buf[REPORT_SIZE];
+	unsigned char mask[REPORT_SIZE];
+	uint64_t timestamp;
 	
 	while (!pd->shutdown) {
 		/* Wait for data to become available. */
-		pthread_mutex_lock(&pd->mutex);
-		pthread_cleanup_push(&cleanup_mutex, pd);
-		while (pd->front_of_buffer == pd->back_of_buffer) {
-			/* No data available. Sleep until there is. */
-			int res = pthread_cond_wait(&pd->cond, &pd->mutex);
-			if (res != 0) {
-				if (pd->error_event_callback)
-					pd->error_event_callback(pd->handle, PIE_HID_WRITE_UNABLE_TO_ACQUIRE_MUTEX);
-				
-				/* Something failed. Re-acquire the
-				   mutex and try again. This is a pretty
-				   serious error and will probably never
-				   happen. */
-				pthread_mutex_lock(&pd->mutex);
-			}
-			
-			if (pd->shutdown)
-				break;
-
-			/* If we're here, then there is either data, or
-			   there was a spurious wakeup, or there was an
-			   error. Either way, try to run the loop again.
-			   The loop will fall out if there is data. */
-		}
+		wait_for_data(pd, NULL, 1);
 
 		/* We came out of the wait, so there either data
 		   available or a shutdown was called for. */
 
-		if (!pd->shutdown && pd->data_event_callback && !pd->disable_data_callback) {
-			if (pd->front_of_buffer != pd->back_of_buffer) {
-				/* There is data available. Copy it to buf. */
-				return_data(pd, buf);
-
+		if (!pd->shutdown && callback_is_active(pd)) {
+			/* Copy the report to buf. Another reader may
+			   have taken it first, in which case just go
+			   back to waiting. */
+			if (return_data(pd, buf, mask, &timestamp) == 0) {
 				/* Call the callback. */
-				pd->data_event_callback(buf, pd->handle, 0);
+				PHIDDataEventDelta callback_delta = pd->data_event_callback_delta;
+				PHIDDataEventEx callback_ex = pd->data_event_callback_ex;
+				PHIDDataEvent callback = pd->data_event_callback;
+				if (callback_delta)
+					callback_delta(buf, mask, pd->handle, 0);
+				else if (callback_ex)
+					callback_ex(buf, pd->handle, 0, timestamp);
+				else if (callback)
+					callback(buf, pd->handle, 0);
 			}
 		}
-
-		pthread_mutex_unlock(&pd->mutex);
-		pthread_cleanup_pop(0);
 	}
+
+	/* If the device went, say so, unless the interface is already
+	   being closed. The callback may call CloseInterface(), which
+	   then leaves this thread to finish on its own, so pd must not be
+	   touched afterwards. */
+	PHIDErrorEvent error_callback = pd->error_event_callback;
+	if (atomic_load(&pd->disconnected) && !atomic_load(&pd->closing) &&
+	    error_callback)
+		error_callback(pd->handle, PIE_HID_READ_BAD_INTERFACE_HANDLE);
 	
 	return NULL;
 }
 
 unsigned int PIE_HID_CALL SetupInterfaceEx(long hnd)
+{
+	return SetupInterfaceEx2(hnd, NULL);
+}
+
+unsigned int PIE_HID_CALL SetupInterfaceEx2(long hnd, const TSetupOptions *options)
 {
 	int res;
 	int ret_val = 0;
-	
-	if (hnd >= MAX_XKEY_DEVICES)
+	unsigned int ring_depth = BUFFER_LENGTH;
+	int overflow_policy = piDropOldest;
+	unsigned int input_transfers = 0;
+	unsigned int write_queue_depth = WRITE_QUEUE_DEPTH;
+	unsigned int input_timeout = 0;
+	
+	struct pie_device *pd = lookup_handle(hnd);
+	if (!pd)
 		return PIE_HID_SETUP_BAD_HANDLE;
-	
-	struct pie_device *pd = &pie_devices[hnd];
+
+	if (options) {
+		if (options->ringDepth != 0)
+			ring_depth = options->ringDepth;
+		overflow_policy = options->overflowPolicy;
+		input_transfers = options->inputTransfers;
+		if (options->writeQueueDepth != 0)
+			write_queue_depth = options->writeQueueDepth;
+		input_timeout = options->inputTimeout;
+	}
+	/* A ring of one report would have nowhere to put the next while
+	   PeekData() lends that one out. */
+	if (ring_depth < 2 || ring_depth > MAX_RING_DEPTH ||
+	    (ring_depth & (ring_depth - 1)) != 0 ||
+	    overflow_policy < piDropOldest || overflow_policy > piCoalesce ||
+	    input_transfers > MAX_INPUT_TRANSFERS ||
+	    write_queue_depth > MAX_WRITE_QUEUE_DEPTH ||
+	    input_timeout > INT_MAX)
+		return PIE_HID_SETUP_INVALID_OPTIONS;
+
+	/* Claim the entry, so that it stays put while the device is open,
+	   even if the device goes. */
+	const struct hid_device_info *info = NULL;
+	pthread_mutex_lock(&registry_lock);
+	if (pd->info && pd->present && !pd->in_use) {
+		pd->in_use = 1;
+		info = pd->info;
+	}
+	pthread_mutex_unlock(&registry_lock);
+	if (!info)
+		return PIE_HID_SETUP_CANNOT_OPEN_READ_HANDLE;
 
 	/* Open the device */
-	pd->dev = hid_open_path(pd->path);
+	pd->dev = hid_open_info(info, input_transfers, input_timeout);
 	if (!pd->dev) {
 		ret_val = PIE_HID_SETUP_CANNOT_OPEN_READ_HANDLE;
 		goto err_open_path;
 	}
 	
 	/* Create the buffer */
-	pd->buffer = calloc(BUFFER_LENGTH, sizeof(struct report));
+	pd->buffer = calloc(ring_depth, sizeof(struct report));
 	if (!pd->buffer) {
 		ret_val = PIE_HID_SETUP_CANNOT_ALLOCATE_MEM_FOR_RING;
 		goto err_alloc_buffer;
 	}
+	pd->buffer_length = ring_depth;
+	pd->overflow_policy = overflow_policy;
+	atomic_store(&pd->front_of_buffer, 0);
+	atomic_store(&pd->back_of_buffer, 0);
+	atomic_store(&pd->overflow_count, 0);
+	atomic_store(&pd->pending_state, PENDING_EMPTY);
+	atomic_store(&pd->event_fd, -1);
+	atomic_store(&pd->event_armed, 0);
+	atomic_store(&pd->peek_slot, PEEK_NONE);
+	atomic_store(&pd->writes_pending, 0);
+	atomic_store(&pd->write_error, 0);
+	atomic_store(&pd->features_pending, 0);
+	pd->write_queue_depth = write_queue_depth;
+	pd->write_length = GetWriteLength(hnd);
+	pd->read_length = GetReadLength(hnd);
+	pd->last_report.length = 0;
+	pd->shutdown = 0;
+	atomic_store(&pd->disconnected, 0);
+	atomic_store(&pd->closing, 0);
 	
-	/* Create the mutex */
-	res = pthread_mutex_init(&pd->mutex, NULL);
-	if (res != 0) {
-		ret_val = PIE_HID_SETUP_CANNOT_CREATE_MUTEX;
-		goto err_create_mutex;
-	}
-	
-	/* Create the condition */
-	res = pthread_cond_init(&pd->cond, NULL);
-	if (res != 0) {
-		ret_val = PIE_HID_SETUP_CANNOT_CREATE_MUTEX;
-		goto err_create_cond;
-	}
+	/* Set Default parameters */
+	pd->suppress_duplicate_reports = true;
+	pd->disable_data_callback = false;
 	
-	/* Start the Read thread */
-	res = pthread_create(&pd->read_thread, NULL, &read_thread, pd);
-	if (res != 0) {
-		ret_val = PIE_HID_SETUP_CANNOT_CREATE_READ_THREAD;
-		goto err_create_read_thread;
-	}
-
 	/* Start the Callback thread */
 	res = pthread_create(&pd->callback_thread, NULL, &callback_thread, pd);
 	if (res != 0) {
 		ret_val = PIE_HID_SETUP_CANNOT_CREATE_READ_THREAD;
 		goto err_create_callback_thread;
 	}
-	
-	/* Set Default parameters */
-	pd->suppress_duplicate_reports = true;
-	pd->disable_data_callback = false;
+
+	/* Have hid-libusb put reports straight into the ring. */
+	hid_set_input_callback(pd->dev, input_report, pd);
 	
 	return ret_val;
 	
 	
 err_create_callback_thread:
-	pd->shutdown = 1;
-	pthread_join(pd->read_thread, NULL);
-err_create_read_thread:
-	pthread_cond_destroy(&pd->cond);
-err_create_cond:
-	pthread_mutex_destroy(&pd->mutex);
-err_create_mutex:
 	free(pd->buffer);
+	pd->buffer = NULL;
 err_alloc_buffer:
 	hid_close(pd->dev);
+	pd->dev = NULL;
 err_open_path:
+	release_entry(pd);
 
 	return ret_val;
 }
 
 void  PIE_HID_CALL CloseInterface(long hnd)
 {
-	if (hnd >= MAX_XKEY_DEVICES)
+	struct pie_device *pd = lookup_handle(hnd);
+	if (!pd || !pd->dev)
 		return;
-	
-	struct pie_device *pd = &pie_devices[hnd];
-
-	/* Stop the threads. pthread_cancel will stop the threads once
-	   they get to a cancellation point. In this case the
-	   pthread_cond_*wait() function (inside hid-libusb.c) is where
-	   they will be cancelled. Once stopped, they will call their
-	   respective cancellation handlers which will release the mutexes
-	   if necessary. */
-	pd->shutdown = 1;
-	pthread_cancel(pd->callback_thread);
-	pthread_cancel(pd->read_thread);
 
-	/* Wait for the threds to stop */
-	pthread_join(pd->callback_thread, NULL);
-	pthread_join(pd->read_thread, NULL);
-	
-	/* Destroy the condition */
-	pthread_cond_destroy(&pd->cond);
+	/* Only one caller closes it, should the application's error
+	   callback race with another thread. */
+	if (atomic_exchange(&pd->closing, 1))
+		return;
 
-	/* Destroy the mutex */
-	pthread_mutex_destroy(&pd->mutex);
-	
-	/* Close the device handle */
+	/* Stop the callback thread. It (and any application thread
+	   blocked in BlockingReadData()) sleeps on wake_seq and notices
+	   the shutdown once woken. */
+	pd->shutdown = 1;
+	wake_all_readers(pd);
+	wake_any_data_waiters();
+
+	/* Wait for the thread to stop, unless this is it, called from a
+	   callback, in which case it stops once the callback returns. */
+	if (pthread_equal(pthread_self(), pd->callback_thread))
+		pthread_detach(pd->callback_thread);
+	else
+		pthread_join(pd->callback_thread, NULL);
+	
+	/* Close the device handle. Once this returns, input_report()
+	   will not be called again, so the buffer can go. */
 	hid_close(pd->dev); //this causes crash if no input endpoint
 	pd->dev = NULL;
 
 	/* Free the buffer */
 	free(pd->buffer);
 	pd->buffer = NULL;
+
+	/* Close the event fd, if there is one */
+	int fd = atomic_exchange(&pd->event_fd, -1);
+	if (fd >= 0)
+		close(fd);
+
+	release_entry(pd);
 }
 
 void  PIE_HID_CALL CleanupInterface(long hnd)
@@ -452,102 +1249,341 @@ void  PIE_HID_CALL CleanupInterface(long hnd)
 	CloseInterface(hnd);
 }
 
-static int return_data(struct pie_device *pd, unsigned char *data)
+/* Copy the first report in the queue to data and remove it from the
+   queue, along with its change mask and timestamp for those which are
+   not NULL. Returns 0 on success or -1 if the queue is empty. Any number
+   of threads may call this at once, concurrently with the producer. */
+static int take_report(struct pie_device *pd, unsigned char *data, unsigned char *mask, uint64_t *timestamp)
 {
-	/* Return the first report in the queue. */
-	struct report *rpt = &pd->buffer[pd->front_of_buffer];
-	memcpy(data, rpt->buffer, rpt->length);
+	unsigned int front;
+	int length;
+
+	do {
+		front = atomic_load_explicit(&pd->front_of_buffer, memory_order_acquire);
+
+		while (front != atomic_load_explicit(&pd->back_of_buffer, memory_order_acquire)) {
+			struct report *rpt = &pd->buffer[front & (pd->buffer_length-1)];
+			length = rpt->length;
+			if (length > REPORT_SIZE)
+				length = REPORT_SIZE;
+			memcpy(data, rpt->buffer, length);
+			if (mask)
+				memcpy(mask, rpt->mask, length);
+			uint64_t ts = rpt->timestamp;
+
+			/* The copy is only good if nobody else consumed this
+			   report while we were copying it, and the producer did
+			   not drop it to make room (which it must do before
+			   reusing the slot). Otherwise front has been
+			   reloaded, so try again. */
+			if (atomic_compare_exchange_weak_explicit(&pd->front_of_buffer,
+			        &front, front + 1,
+			        memory_order_acq_rel, memory_order_acquire)) {
+				if (timestamp)
+					*timestamp = ts;
+				return 0;
+			}
+		}
+
+		/* The ring is empty, but a coalesced overflow report (which
+		   is newer than anything that was in the ring) may be
+		   waiting. */
+		length = take_pending(pd, data, mask, REPORT_SIZE, timestamp);
+	} while (length == -2);
+
+	return length < 0 ? -1 : 0;
+}
+
+/* Copy up to max_reports reports from the front of the queue to data,
+   one every stride bytes, and remove them from the queue with a single
+   compare-and-swap. Returns the number of reports copied. */
+static int take_report_batch(struct pie_device *pd, unsigned char *data, int stride, int max_reports)
+{
+	unsigned int front = atomic_load_explicit(&pd->front_of_buffer, memory_order_acquire);
+	int count;
+
+	for (;;) {
+		unsigned int back = atomic_load_explicit(&pd->back_of_buffer, memory_order_acquire);
+
+		count = 0;
+		while (front + count != back && count < max_reports) {
+			struct report *rpt = &pd->buffer[(front + count) & (pd->buffer_length-1)];
+			int length = rpt->length;
+			if (length > stride)
+				length = stride;
+			if (length > REPORT_SIZE)
+				length = REPORT_SIZE;
+			memcpy(data + count * stride, rpt->buffer, length);
+			count++;
+		}
+
+		/* As in take_report(), the copies are only good if nothing
+		   moved the front while we were making them. */
+		if (count == 0 ||
+		    atomic_compare_exchange_strong_explicit(&pd->front_of_buffer,
+		        &front, front + count,
+		        memory_order_acq_rel, memory_order_acquire))
+			break;
+	}
+
+	/* The ring has been drained, so a coalesced overflow report can
+	   go on the end, unless the ring has been refilled meanwhile. */
+	if (count < max_reports &&
+	    front + count == atomic_load(&pd->back_of_buffer) &&
+	    take_pending(pd, data + count * stride, NULL, stride, NULL) >= 0)
+		count++;
+
+	return count;
+}
+
+/* take_report(), re-arming the event fd if the ring is empty. */
+static int return_data(struct pie_device *pd, unsigned char *data, unsigned char *mask, uint64_t *timestamp)
+{
+	if (take_report(pd, data, mask, timestamp) == 0)
+		return 0;
+	if (rearm_event_fd(pd) && take_report(pd, data, mask, timestamp) == 0)
+		return 0;
+	return -1;
+}
+
+/* take_report_batch(), re-arming the event fd if the ring is empty. */
+static int return_data_batch(struct pie_device *pd, unsigned char *data, int stride, int max_reports)
+{
+	int count = take_report_batch(pd, data, stride, max_reports);
+
+	if (count == 0 && rearm_event_fd(pd))
+		count = take_report_batch(pd, data, stride, max_reports);
+	return count;
+}
+
+/* Claim the first report in the queue as take_report() does, but lend
+   out the slot it is in instead of copying it. The caller must already
+   own peek_slot. Returns 0 on success or -1 if the queue is empty. */
+static int peek_report(struct pie_device *pd, const unsigned char **ptr, int *len)
+{
+	unsigned int front;
+	int length;
+	
+	do {
+		front = atomic_load_explicit(&pd->front_of_buffer, memory_order_acquire);
+		
+		while (front != atomic_load_explicit(&pd->back_of_buffer, memory_order_acquire)) {
+			/* Mark the slot as lent before claiming the report in
+			   it, so the producer cannot see it free and reuse it. */
+			atomic_store(&pd->peek_slot, (front & (pd->buffer_length-1)) + 1);
+			if (atomic_compare_exchange_weak(&pd->front_of_buffer, &front, front + 1)) {
+				struct report *rpt = &pd->buffer[front & (pd->buffer_length-1)];
+				*ptr = (const unsigned char *)rpt->buffer;
+				*len = rpt->length;
+				return 0;
+			}
+		}
+		
+		/* A coalesced overflow report cannot be lent out without
+		   holding up the producer, so it is copied. */
+		atomic_store(&pd->peek_slot, PEEK_COPY);
+		length = take_pending(pd, (unsigned char *)pd->peek_copy.buffer, NULL, REPORT_SIZE, NULL);
+	} while (length == -2);
+	
+	if (length < 0)
+		return -1;
 	
-	/* Increment the front of buffer pointer. */
-	pd->front_of_buffer++;
-	if (pd->front_of_buffer >= BUFFER_LENGTH)
-		pd->front_of_buffer = 0;
+	*ptr = (const unsigned char *)pd->peek_copy.buffer;
+	*len = length;
+	return 0;
 }
 
 unsigned int PIE_HID_CALL ReadData(long hnd, unsigned char *data)
 {
-	if (hnd >= MAX_XKEY_DEVICES)
+	return ReadDataEx(hnd, data, NULL);
+}
+
+unsigned int PIE_HID_CALL ReadDataEx(long hnd, unsigned char *data, unsigned long long *timestamp)
+{
+	uint64_t ts;
+
+	struct pie_device *pd = lookup_handle(hnd);
+	if (!pd)
 		return PIE_HID_READ_BAD_INTERFACE_HANDLE;
 	
-	struct pie_device *pd = &pie_devices[hnd];
-	
-	pthread_mutex_lock(&pd->mutex);
-	
 	/* Return early if there is no data available */
-	if (pd->front_of_buffer == pd->back_of_buffer) {
-		/* No data available. */
-		pthread_mutex_unlock(&pd->mutex);
+	if (return_data(pd, data, NULL, &ts) != 0)
 		return PIE_HID_READ_INSUFFICIENT_DATA;
-	}
 
-	return_data(pd, data);
-
-	pthread_mutex_unlock(&pd->mutex);
-	
+	if (timestamp)
+		*timestamp = ts;
 	return 0;	
 }
 
-static int cond_timedwait(pthread_cond_t *cond, pthread_mutex_t *mutex, const struct timespec *abstime, const struct pie_device *pd)
+unsigned int PIE_HID_CALL ReadDataDelta(long hnd, unsigned char *data, unsigned char *mask)
 {
-	while (pd->front_of_buffer == pd->back_of_buffer && !pd->shutdown) {
-		int res = pthread_cond_timedwait(cond, mutex, abstime);
-		if (res == ETIMEDOUT)
-			return res;
-		if (res != 0)
-			return res;
-		/* A res of 0 means we may have been signaled or it may
-		   be a spurious wakeup. Check to see that there's acutally
-		   data in the queue before returning, and if not, go back
-		   to sleep. See the pthread_cond_timedwait() man page for
-		   details. */
-	}
+	struct pie_device *pd = lookup_handle(hnd);
+	if (!pd)
+		return PIE_HID_READ_BAD_INTERFACE_HANDLE;
 	
+	if (return_data(pd, data, mask, NULL) != 0)
+		return PIE_HID_READ_INSUFFICIENT_DATA;
+
 	return 0;
 }
 
-unsigned int PIE_HID_CALL BlockingReadData(long hnd, unsigned char *data, int maxMillis)
+unsigned int PIE_HID_CALL PeekData(long hnd, const unsigned char **ptr, int *len)
 {
-	if (hnd >= MAX_XKEY_DEVICES)
+	struct pie_device *pd = lookup_handle(hnd);
+	if (!pd)
 		return PIE_HID_READ_BAD_INTERFACE_HANDLE;
+	unsigned int slot = PEEK_NONE;
 	
-	struct pie_device *pd = &pie_devices[hnd];
+	/* Only one report may be lent out at a time. */
+	if (!atomic_compare_exchange_strong(&pd->peek_slot, &slot, PEEK_COPY))
+		return PIE_HID_READ_PEEK_MISMATCH;
 	
-	pthread_mutex_lock(&pd->mutex);
+	if (peek_report(pd, ptr, len) == 0)
+		return 0;
+	if (rearm_event_fd(pd) && peek_report(pd, ptr, len) == 0)
+		return 0;
+	
+	atomic_store(&pd->peek_slot, PEEK_NONE);
+	return PIE_HID_READ_INSUFFICIENT_DATA;
+}
+
+unsigned int PIE_HID_CALL ReleaseData(long hnd)
+{
+	struct pie_device *pd = lookup_handle(hnd);
+	if (!pd)
+		return PIE_HID_READ_BAD_INTERFACE_HANDLE;
+	
+	/* Hand the slot back to the producer. */
+	if (atomic_exchange(&pd->peek_slot, PEEK_NONE) == PEEK_NONE)
+		return PIE_HID_READ_PEEK_MISMATCH;
+	
+	return 0;
+}
+
+unsigned int PIE_HID_CALL BlockingReadData(long hnd, unsigned char *data, int maxMillis)
+{
+	return BlockingReadDataEx(hnd, data, maxMillis, NULL);
+}
+
+unsigned int PIE_HID_CALL BlockingReadDataEx(long hnd, unsigned char *data, int maxMillis, unsigned long long *timestamp)
+{
+	uint64_t ts;
+
+	struct pie_device *pd = lookup_handle(hnd);
+	if (!pd)
+		return PIE_HID_READ_BAD_INTERFACE_HANDLE;
 	
+	struct timespec abstime;
+	make_timeout(&abstime, maxMillis);
+
 	/* Go to sleep if there is no data available */
-	if (pd->front_of_buffer == pd->back_of_buffer) {
+	while (return_data(pd, data, NULL, &ts) != 0) {
 		/* No data available. Sleep until there is. */
-		struct timespec abstime;
-		make_timeout(&abstime, maxMillis);
-		
-		int res = cond_timedwait(&pd->cond, &pd->mutex, &abstime, pd);
-		if (res == ETIMEDOUT) {
-			pthread_mutex_unlock(&pd->mutex);
+		int res = wait_for_data(pd, &abstime, 0);
+		if (res == ETIMEDOUT || pd->shutdown) {
+			/* One last look, in case the report arrived just
+			   as we gave up. */
+			if (return_data(pd, data, NULL, &ts) == 0)
+				break;
 			return PIE_HID_READ_INSUFFICIENT_DATA;
 		}
-		else if (res != 0) {
-			return PIE_HID_READ_CANNOT_ACQUIRE_MUTEX;
+	}
+
+	if (timestamp)
+		*timestamp = ts;
+	return 0;
+}
+
+unsigned int PIE_HID_CALL ReadDataBatch(long hnd, unsigned char *data, int stride, int maxReports, int *count, int maxMillis)
+{
+	struct pie_device *pd = lookup_handle(hnd);
+	if (!pd)
+		return PIE_HID_READ_BAD_INTERFACE_HANDLE;
+	if (stride <= 0 || maxReports <= 0)
+		return PIE_HID_READ_LENGTH_ZERO;
+	/* Each report would be cut short. */
+	if (stride < pd->read_length)
+		return PIE_HID_READ_STRIDE_TOO_SHORT;
+
+	struct timespec abstime;
+	make_timeout(&abstime, maxMillis);
+
+	/* Take whatever is there, sleeping first if there is nothing. */
+	while ((*count = return_data_batch(pd, data, stride, maxReports)) == 0) {
+		if (maxMillis <= 0 || pd->shutdown ||
+		    wait_for_data(pd, &abstime, 0) == ETIMEDOUT) {
+			/* One last look, in case the report arrived just
+			   as we gave up. */
+			*count = return_data_batch(pd, data, stride, maxReports);
+			if (*count == 0)
+				return PIE_HID_READ_INSUFFICIENT_DATA;
+			break;
 		}
 	}
 
-	/* If we got to this point, there is either data here or there was
-	   an error. In either case, this thread is holding the mutex. */
-	   
-	if (pd->front_of_buffer != pd->back_of_buffer)
-		return_data(pd, data);
-        
-	pthread_mutex_unlock(&pd->mutex);
-	
 	return 0;
 }
 
+unsigned int PIE_HID_CALL WaitForAnyData(const long *handles, int n, int maxMillis, long *readyHandle)
+{
+	unsigned int ret_val = PIE_HID_READ_INSUFFICIENT_DATA;
+	struct timespec abstime, ts;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (!lookup_handle(handles[i]))
+			return PIE_HID_READ_BAD_INTERFACE_HANDLE;
+	}
+
+	make_timeout(&abstime, maxMillis);
+
+	atomic_fetch_add(&any_data_waiters, 1);
+	while (ret_val == PIE_HID_READ_INSUFFICIENT_DATA) {
+		unsigned int seq = atomic_load(&any_data_seq);
+		int start = n > 0? atomic_fetch_add(&any_data_start, 1) % n: 0;
+
+		/* Look for a handle with data, or one whose device is
+		   gone. Start somewhere different each time, so that one
+		   busy device can't hide the others. */
+		for (i = 0; i < n; i++) {
+			long hnd = handles[(start + i) % n];
+			struct pie_device *pd = lookup_handle(hnd);
+
+			if (!pd) {
+				ret_val = PIE_HID_READ_BAD_INTERFACE_HANDLE;
+			}
+			else if (!buffer_is_empty(pd)) {
+				ret_val = 0;
+			}
+			else if (pd->shutdown) {
+				ret_val = PIE_HID_READ_INVALID_HANDLE;
+			}
+			else
+				continue;
+
+			*readyHandle = hnd;
+			break;
+		}
+
+		if (ret_val != PIE_HID_READ_INSUFFICIENT_DATA ||
+		    maxMillis <= 0 || !time_remaining(&abstime, &ts))
+			break;
+
+		/* Returns immediately if any_data_seq has moved on since
+		   it was sampled above. */
+		futex_wait(&any_data_seq, seq, &ts);
+	}
+	atomic_fetch_sub(&any_data_waiters, 1);
+
+	return ret_val;
+}
+
 unsigned int PIE_HID_CALL WriteData(long hnd, unsigned char *data)
 {
-	if (hnd >= MAX_XKEY_DEVICES)
+	struct pie_device *pd = lookup_handle(hnd);
+	if (!pd)
 		return PIE_HID_WRITE_BAD_HANDLE;
 	
-	struct pie_device *pd = &pie_devices[hnd];
-	
 	int res = hid_write(pd->dev, data, GetWriteLength(hnd));
 	if (res < 0)
 		return PIE_HID_WRITE_FAILED;
@@ -557,56 +1593,297 @@ unsigned int PIE_HID_CALL WriteData(long hnd, unsigned char *data)
 	return 0;
 }
 
-unsigned int PIE_HID_CALL FastWrite(long hnd, unsigned char *data)
+/* Called by hid-libusb on its event handling thread when a write from
+   WriteDataAsync() completes. */
+static void HID_API_CALL write_done(hid_device *dev, int result, void *user_data)
 {
-	return WriteData(hnd, data);
+	struct pie_device *pd = user_data;
+	unsigned int status = 0;
+
+	if (result < 0)
+		status = PIE_HID_WRITE_FAILED;
+	else if (result != pd->write_length)
+		status = PIE_HID_WRITE_INCOMPLETE;
+
+	/* Keep the first failure for WriteDataAsync() to report. */
+	if (status) {
+		unsigned int none = 0;
+		atomic_compare_exchange_strong(&pd->write_error, &none,
+		    status == PIE_HID_WRITE_FAILED ?
+		        PIE_HID_WRITE_PREV_WRITE_FAILED :
+		        PIE_HID_WRITE_PREV_WRITE_WRONG_NUMBER);
+	}
+
+	/* Give up the slot before the callback, so that it can queue
+	   the next write straight away. */
+	atomic_fetch_sub(&pd->writes_pending, 1);
+
+	PHIDWriteEvent callback = pd->write_event_callback;
+	if (callback)
+		callback(pd->handle, status);
 }
 
-unsigned int PIE_HID_CALL ReadLast(long hnd, unsigned char *data)
+unsigned int PIE_HID_CALL WriteDataAsync(long hnd, unsigned char *data)
 {
-	if (hnd >= MAX_XKEY_DEVICES)
-		return PIE_HID_READ_BAD_INTERFACE_HANDLE;
+	struct pie_device *pd = lookup_handle(hnd);
+	if (!pd)
+		return PIE_HID_WRITE_BAD_HANDLE;
+	
+	if (!pd->dev)
+		return PIE_HID_WRITE_HANDLE_INVALID;
+
+	/* Mice and joysticks have no output report, unknown PIDs give -1. */
+	if (pd->write_length <= 0)
+		return PIE_HID_WRITE_LENGTH_ZERO;
 
-	struct pie_device *pd = &pie_devices[hnd];
+	/* Report an earlier write which failed, once. This write is not
+	   sent; the caller passes it again. */
+	unsigned int err = atomic_exchange(&pd->write_error, 0);
+	if (err)
+		return err;
+	
+	if (atomic_fetch_add(&pd->writes_pending, 1) >= pd->write_queue_depth) {
+		atomic_fetch_sub(&pd->writes_pending, 1);
+		return PIE_HID_WRITE_BUFFER_FULL;
+	}
+	
+	if (hid_write_async(pd->dev, data, pd->write_length, write_done, pd) < 0) {
+		atomic_fetch_sub(&pd->writes_pending, 1);
+		return PIE_HID_WRITE_FAILED;
+	}
 	
-	pthread_mutex_lock(&pd->mutex);
+	return 0;
+}
 
-	/* If the buffer is empty, return insufficient data. */
-	if (pd->front_of_buffer == pd->back_of_buffer) {
-		pthread_mutex_unlock(&pd->mutex);
-		return PIE_HID_READ_INSUFFICIENT_DATA;
+/* Called by hid-libusb on its event handling thread when a request from
+   SetFeatureReportAsync() or GetFeatureReportAsync() completes. */
+static void HID_API_CALL feature_done(hid_device *dev, const unsigned char *data, int result, void *user_data)
+{
+	struct pie_device *pd = user_data;
+	unsigned int status = result < 0 ? PIE_HID_FEATURE_FAILED : 0;
+
+	/* Give up the slot before the callback, so that it can ask for
+	   the next report straight away. */
+	atomic_fetch_sub(&pd->features_pending, 1);
+
+	PHIDFeatureEvent callback = pd->feature_event_callback;
+	if (callback)
+		callback((unsigned char *)data, result < 0 ? 0 : result,
+		    pd->handle, status);
+}
+
+/* Reserve one of the device's feature request slots. */
+static unsigned int reserve_feature_request(struct pie_device *pd)
+{
+	if (!pd->dev)
+		return PIE_HID_FEATURE_BAD_HANDLE;
+
+	if (atomic_fetch_add(&pd->features_pending, 1) >= MAX_FEATURE_QUEUE_DEPTH) {
+		atomic_fetch_sub(&pd->features_pending, 1);
+		return PIE_HID_FEATURE_QUEUE_FULL;
 	}
+
+	return 0;
+}
+
+/* Send a feature report, data[0] being its ID, without waiting for the
+   device. Requests to any number of devices may be outstanding at once;
+   each completes through the SetFeatureCallback() callback. */
+unsigned int PIE_HID_CALL SetFeatureReportAsync(long hnd, unsigned char *data, int length)
+{
+	struct pie_device *pd = lookup_handle(hnd);
+	if (!pd)
+		return PIE_HID_FEATURE_BAD_HANDLE;
 	
-	/* Find the last item in the buffer. */
-	int last = pd->back_of_buffer - 1;
-	if (last < 0)
-		last = BUFFER_LENGTH -1;
+	if (length < 2)
+		return PIE_HID_FEATURE_BAD_LENGTH;
+
+	unsigned int err = reserve_feature_request(pd);
+	if (err)
+		return err;
 	
-	/* Return the first report in the queue. */
-	struct report *rpt = &pd->buffer[last];
-	memcpy(data, rpt->buffer, rpt->length);
+	if (hid_send_feature_report_async(pd->dev, data, length, feature_done, pd) < 0) {
+		atomic_fetch_sub(&pd->features_pending, 1);
+		return PIE_HID_FEATURE_FAILED;
+	}
 	
-	pthread_mutex_unlock(&pd->mutex);
+	return 0;
+}
+
+/* Ask for a feature report of length bytes, including the ID in front,
+   which is passed to the SetFeatureCallback() callback. */
+unsigned int PIE_HID_CALL GetFeatureReportAsync(long hnd, unsigned char reportID, int length)
+{
+	struct pie_device *pd = lookup_handle(hnd);
+	if (!pd)
+		return PIE_HID_FEATURE_BAD_HANDLE;
+	
+	if (length < 2)
+		return PIE_HID_FEATURE_BAD_LENGTH;
+
+	unsigned int err = reserve_feature_request(pd);
+	if (err)
+		return err;
+	
+	if (hid_get_feature_report_async(pd->dev, reportID, length, feature_done, pd) < 0) {
+		atomic_fetch_sub(&pd->features_pending, 1);
+		return PIE_HID_FEATURE_FAILED;
+	}
+	
+	return 0;
+}
+
+unsigned int PIE_HID_CALL FastWrite(long hnd, unsigned char *data)
+{
+	struct pie_device *pd = lookup_handle(hnd);
+	if (!pd)
+		return PIE_HID_WRITE_BAD_HANDLE;
+	
+	/* It would overtake them. */
+	if (atomic_load(&pd->writes_pending) != 0)
+		return PIE_HID_WRITE_FAST_WRITE_ERROR;
+	
+	return WriteData(hnd, data);
+}
+
+unsigned int PIE_HID_CALL ReadLast(long hnd, unsigned char *data)
+{
+	struct pie_device *pd = lookup_handle(hnd);
+	if (!pd)
+		return PIE_HID_READ_BAD_INTERFACE_HANDLE;
+	unsigned int back;
+
+	/* A coalesced overflow report is newer than anything in the ring.
+	   Copy it without taking it, retrying if the producer replaced it
+	   meanwhile, so that other readers never find it busy. */
+	if (atomic_load(&pd->pending_state) != PENDING_EMPTY) {
+		unsigned int seq;
+		int length;
+		do {
+			seq = atomic_load_explicit(&pd->pending_seq, memory_order_acquire);
+			length = pd->pending_report.length;
+			if (length > REPORT_SIZE)
+				length = REPORT_SIZE;
+			memcpy(data, pd->pending_report.buffer, length);
+			atomic_thread_fence(memory_order_acquire);
+		} while ((seq & 1) ||
+		         atomic_load_explicit(&pd->pending_seq, memory_order_relaxed) != seq);
+		return 0;
+	}
+
+	do {
+		back = atomic_load_explicit(&pd->back_of_buffer, memory_order_acquire);
+
+		/* If the buffer is empty, return insufficient data. */
+		if (atomic_load_explicit(&pd->front_of_buffer, memory_order_acquire) == back)
+			return PIE_HID_READ_INSUFFICIENT_DATA;
+
+		/* Copy the last item in the buffer. */
+		struct report *rpt = &pd->buffer[(back - 1) & (pd->buffer_length-1)];
+		int length = rpt->length;
+		if (length > REPORT_SIZE)
+			length = REPORT_SIZE;
+		memcpy(data, rpt->buffer, length);
+
+		/* If the producer has not added anything since, it
+		   has not started reusing that slot either. */
+		atomic_thread_fence(memory_order_acquire);
+	} while (atomic_load_explicit(&pd->back_of_buffer, memory_order_relaxed) != back);
 	
 	return 0;
 }
 
+unsigned int PIE_HID_CALL ReadCurrentState(long hnd, unsigned char *data)
+{
+	struct pie_device *pd = lookup_handle(hnd);
+	if (!pd)
+		return PIE_HID_READ_BAD_INTERFACE_HANDLE;
+	unsigned int seq;
+	int length;
+
+	/* Copy the last report received, which stays put however much of
+	   the ring has been consumed. The producer only holds state_seq odd
+	   for one short memcpy(), so a retry is rare and brief. */
+	do {
+		seq = atomic_load_explicit(&pd->state_seq, memory_order_acquire);
+		length = pd->last_report.length;
+		if (length > REPORT_SIZE-1)
+			length = REPORT_SIZE-1;
+		memcpy(data+1, pd->last_report.buffer, length);
+		atomic_thread_fence(memory_order_acquire);
+	} while ((seq & 1) ||
+	         atomic_load_explicit(&pd->state_seq, memory_order_relaxed) != seq);
+
+	if (length <= 0)
+		return PIE_HID_READ_INSUFFICIENT_DATA;
+
+	/* Add the report number, as for reports from the ring. */
+	data[0] = 0;
+	return 0;
+}
+
 unsigned int PIE_HID_CALL ClearBuffer(long hnd)
 {
-	if (hnd >= MAX_XKEY_DEVICES)
+	struct pie_device *pd = lookup_handle(hnd);
+	if (!pd)
 		return PIE_HID_CLEARBUFFER_BAD_HANDLE;
+	unsigned int front = atomic_load(&pd->front_of_buffer);
+
+	/* Consume everything that has been read so far. */
+	while (!atomic_compare_exchange_weak(&pd->front_of_buffer,
+	           &front, atomic_load(&pd->back_of_buffer)))
+		;
+
+	/* Along with any coalesced overflow report. */
+	int state = PENDING_FULL;
+	atomic_compare_exchange_strong(&pd->pending_state, &state, PENDING_EMPTY);
+
+	return 0;
+}
 
-	struct pie_device *pd = &pie_devices[hnd];
+int PIE_HID_CALL GetReadEventFd(long hnd)
+{
+	struct pie_device *pd = lookup_handle(hnd);
+	if (!pd)
+		return -1;
+	int fd = atomic_load(&pd->event_fd);
+
+	if (fd >= 0 || !pd->dev)
+		return fd;
+
+	/* Create it on first use. If another thread beat us to it, use
+	   theirs. */
+	fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	int existing = -1;
+	if (!atomic_compare_exchange_strong(&pd->event_fd, &existing, fd)) {
+		close(fd);
+		return existing;
+	}
+
+	/* Start out readable if there is already something to read. */
+	atomic_store(&pd->event_armed, 1);
+	if (!buffer_is_empty(pd))
+		wake_readers(pd);
+
+	return fd;
+}
+
+unsigned int PIE_HID_CALL GetOverflowCount(long hnd)
+{
+	struct pie_device *pd = lookup_handle(hnd);
+	if (!pd)
+		return 0;
 
-	pthread_mutex_lock(&pd->mutex);
-	pd->front_of_buffer = 0;
-	pd->back_of_buffer = 0;
-	pthread_mutex_unlock(&pd->mutex);
+	return atomic_load(&pd->overflow_count);
 }
 
 unsigned int PIE_HID_CALL GetReadLength(long hnd) //patti changed 10/24/17
 {
-	struct pie_device *pd = &pie_devices[hnd];
+	struct pie_device *pd = lookup_handle(hnd);
+	if (!pd)
+		return -1;
         int pid = pd->pid;
 	int interface1 = pd->interfacenumber;
 
@@ -629,7 +1906,9 @@ unsigned int PIE_HID_CALL GetReadLength(long hnd) //patti changed 10/24/17
 
 unsigned int PIE_HID_CALL GetWriteLength(long hnd) //patti changed 10/24/17
 {
-	struct pie_device *pd = &pie_devices[hnd];
+	struct pie_device *pd = lookup_handle(hnd);
+	if (!pd)
+		return -1;
         int pid = pd->pid;
 	int interface1 = pd->interfacenumber;
 
@@ -652,23 +1931,80 @@ unsigned int PIE_HID_CALL GetWriteLength(long hnd) //patti changed 10/24/17
 
 unsigned int PIE_HID_CALL SetDataCallback(long hnd, PHIDDataEvent pDataEvent)
 {
-	if (hnd >= MAX_XKEY_DEVICES)
+	struct pie_device *pd = lookup_handle(hnd);
+	if (!pd)
 		return PIE_HID_DATACALLBACK_BAD_HANDLE;
 	
-	struct pie_device *pd = &pie_devices[hnd];
-	
+	pd->data_event_callback_ex = NULL;
+	pd->data_event_callback_delta = NULL;
 	pd->data_event_callback = pDataEvent;	
 	
+	/* Let the callback thread know it has work to do. */
+	wake_all_readers(pd);
+	
+	return 0;
+}
+
+unsigned int PIE_HID_CALL SetDataCallbackEx(long hnd, PHIDDataEventEx pDataEvent)
+{
+	struct pie_device *pd = lookup_handle(hnd);
+	if (!pd)
+		return PIE_HID_DATACALLBACK_BAD_HANDLE;
+	
+	pd->data_event_callback = NULL;
+	pd->data_event_callback_delta = NULL;
+	pd->data_event_callback_ex = pDataEvent;
+	
+	/* Let the callback thread know it has work to do. */
+	wake_all_readers(pd);
+	
+	return 0;
+}
+
+unsigned int PIE_HID_CALL SetDataCallbackDelta(long hnd, PHIDDataEventDelta pDataEvent)
+{
+	struct pie_device *pd = lookup_handle(hnd);
+	if (!pd)
+		return PIE_HID_DATACALLBACK_BAD_HANDLE;
+	
+	pd->data_event_callback = NULL;
+	pd->data_event_callback_ex = NULL;
+	pd->data_event_callback_delta = pDataEvent;
+	
+	/* Let the callback thread know it has work to do. */
+	wake_all_readers(pd);
+	
+	return 0;
+}
+
+unsigned int PIE_HID_CALL SetWriteCallback(long hnd, PHIDWriteEvent pWriteEvent)
+{
+	struct pie_device *pd = lookup_handle(hnd);
+	if (!pd)
+		return PIE_HID_WRITE_BAD_HANDLE;
+	
+	pd->write_event_callback = pWriteEvent;
+
+	return 0;
+}
+
+unsigned int PIE_HID_CALL SetFeatureCallback(long hnd, PHIDFeatureEvent pFeatureEvent)
+{
+	struct pie_device *pd = lookup_handle(hnd);
+	if (!pd)
+		return PIE_HID_FEATURE_BAD_HANDLE;
+	
+	pd->feature_event_callback = pFeatureEvent;
+
 	return 0;
 }
 
 unsigned int PIE_HID_CALL SetErrorCallback(long hnd, PHIDErrorEvent pErrorCall)
 {
-	if (hnd >= MAX_XKEY_DEVICES)
+	struct pie_device *pd = lookup_handle(hnd);
+	if (!pd)
 		return PIE_HID_ERRORCALLBACK_BAD_HANDLE;
 	
-	struct pie_device *pd = &pie_devices[hnd];
-	
 	pd->error_event_callback = pErrorCall;
 
 	return 0;
@@ -676,41 +2012,38 @@ unsigned int PIE_HID_CALL SetErrorCallback(long hnd, PHIDErrorEvent pErrorCall)
 
 void PIE_HID_CALL SuppressDuplicateReports(long hnd,bool supp)
 {
-	if (hnd >= MAX_XKEY_DEVICES)
+	struct pie_device *pd = lookup_handle(hnd);
+	if (!pd)
 		return;
-
-	struct pie_device *pd = &pie_devices[hnd];
 	
 	pd->suppress_duplicate_reports = supp;
 }
 
 void PIE_HID_CALL DisableDataCallback(long hnd,bool disable)
 {
-	if (hnd >= MAX_XKEY_DEVICES)
+	struct pie_device *pd = lookup_handle(hnd);
+	if (!pd)
 		return;
-
-	struct pie_device *pd = &pie_devices[hnd];
 	
 	pd->disable_data_callback = disable;
+	wake_all_readers(pd);
 }
 
 bool PIE_HID_CALL IsDataCallbackDisabled(long hnd)
 {
-	if (hnd >= MAX_XKEY_DEVICES)
+	struct pie_device *pd = lookup_handle(hnd);
+	if (!pd)
 		return false;
-
-	struct pie_device *pd = &pie_devices[hnd];
 	
 	return pd->disable_data_callback;
 }
 
 bool PIE_HID_CALL GetSuppressDuplicateReports(long hnd)
 {
-	if (hnd >= MAX_XKEY_DEVICES)
+	struct pie_device *pd = lookup_handle(hnd);
+	if (!pd)
 		return false;
 	
-	struct pie_device *pd = &pie_devices[hnd];
-	
 	return pd->suppress_duplicate_reports;
 }
 
@@ -756,6 +2089,9 @@ void PIE_HID_CALL GetErrorString(int err, char* out_str, int size)
 	case PIE_HID_ENUMERATE_GET_PRODUCT_STRING:
 		str = "112 HidD_GetProductString error";
 		break;
+	case PIE_HID_ENUMERATE_MORE_DATA:
+		str = "113 More interfaces than fit in the array";
+		break;
 	case PIE_HID_SETUP_BAD_HANDLE:
 		str = "201 Bad interface handle";
 		break;
@@ -786,6 +2122,9 @@ void PIE_HID_CALL GetErrorString(int err, char* out_str, int size)
 	case PIE_HID_SETUP_CANNOT_OPEN_WRITE_HANDLE_BAD_PATH:
 		str = "210 No write handle - bad DevicePath"; 
 		break;
+	case PIE_HID_SETUP_INVALID_OPTIONS:
+		str = "211 Invalid ring depth, overflow policy, input transfer count or write queue depth";
+		break;
 	case PIE_HID_READ_BAD_INTERFACE_HANDLE:
 		str = "301 Bad interface handle";
 		break;
@@ -819,6 +2158,12 @@ void PIE_HID_CALL GetErrorString(int err, char* out_str, int size)
 	case PIE_HID_READ_BLOCKING_READ_DATA_TIMED_OUT:
 		str = "311 BlockingReadData timed out.";
 		break;
+	case PIE_HID_READ_PEEK_MISMATCH:
+		str = "312 PeekData and ReleaseData calls do not pair up";
+		break;
+	case PIE_HID_READ_STRIDE_TOO_SHORT:
+		str = "313 Stride is shorter than a report";
+		break;
 	case PIE_HID_WRITE_BAD_HANDLE:
 		str = "401 Bad interface handle";
 		break;
@@ -915,6 +2260,21 @@ void PIE_HID_CALL GetErrorString(int err, char* out_str, int size)
 	case PIE_HID_ERRORCALLBACK_ERROR_THREAD_ALREADY_CREATED:
 		str = "1804 Error thread already created";
 		break;
+	case PIE_HID_INIT_FAILED:
+		str = "901 Could not initialize the USB library";
+		break;
+	case PIE_HID_FEATURE_BAD_HANDLE:
+		str = "1001 Bad interface handle";
+		break;
+	case PIE_HID_FEATURE_FAILED:
+		str = "1002 Feature report request failed";
+		break;
+	case PIE_HID_FEATURE_QUEUE_FULL:
+		str = "1003 Too many feature requests outstanding";
+		break;
+	case PIE_HID_FEATURE_BAD_LENGTH:
+		str = "1004 Report length out of range";
+		break;
 	default:
 		str = "Unknown error code";
 		break;
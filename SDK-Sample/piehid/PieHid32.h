@@ -28,6 +28,14 @@ typedef enum {
 	piDataChange = 2
 } EEventPI;
 
+/* What to do with a report that arrives while the ring is full. */
+typedef enum {
+	piDropOldest = 0, /* discard the oldest queued report */
+	piDropNewest = 1, /* discard the arriving report */
+	piCoalesce = 2    /* keep the arriving report in place of any
+	                     earlier overflow, queued once there is room */
+} EOverflowPI;
+
 #define MAX_XKEY_DEVICES 128
 #define PI_VID 0x5F3
 
@@ -46,6 +54,7 @@ typedef enum {
 #define PIE_HID_ENUMERATE_GET_CAPS 110
 #define PIE_HID_ENUMERATE_GET_MANUFACTURER_STRING 111
 #define PIE_HID_ENUMERATE_GET_PRODUCT_STRING 112
+#define PIE_HID_ENUMERATE_MORE_DATA 113 /* EnumeratePIEEx() found more interfaces than maxCount */
 
 // SetupInterface() errors
 #define PIE_HID_SETUP_BAD_HANDLE 201 /* Bad interface handle */
@@ -58,6 +67,7 @@ typedef enum {
 #define PIE_HID_SETUP_CANNOT_OPEN_WRITE_HANDLE 208 /* Cannot open write handle */
 #define PIE_HID_SETUP_CANNOT_OPEN_WRITE_HANDLE_ACCESS_DENIED 209 /* Cannot open write handle - Access Denied */
 #define PIE_HID_SETUP_CANNOT_OPEN_WRITE_HANDLE_BAD_PATH 210 /* Cannot open write handle - bad DevicePath */
+#define PIE_HID_SETUP_INVALID_OPTIONS 211 /* Ring depth not a power of two up to MAX_RING_DEPTH, unknown overflow policy, or too many input transfers or queued writes */
 
 // ReadData() errors
 #define PIE_HID_READ_BAD_INTERFACE_HANDLE 301 /* Bad interface handle */
@@ -71,6 +81,8 @@ typedef enum {
 #define PIE_HID_READ_READ_ERROR 309
 #define PIE_HID_READ_BYTES_NOT_EQUAL_READSIZE 310
 #define PIE_HID_READ_BLOCKING_READ_DATA_TIMED_OUT 311
+#define PIE_HID_READ_PEEK_MISMATCH 312 /* PeekData() while a report is still lent out, or ReleaseData() with none */
+#define PIE_HID_READ_STRIDE_TOO_SHORT 313 /* ReadDataBatch() stride less than readSize */
 
 // Write() errors
 #define PIE_HID_WRITE_BAD_HANDLE 401 /* Bad interface handle */
@@ -81,8 +93,8 @@ typedef enum {
 #define PIE_HID_WRITE_UNABLE_TO_RELEASE_MUTEX 406 /* unable to release write mutex */
 #define PIE_HID_WRITE_HANDLE_INVALID 407 /* Handle Invalid or Device_Not_Found (probably device unplugged) (previous buffered write) */
 #define PIE_HID_WRITE_BUFFER_FULL 408 /* Buffer full */
-#define PIE_HID_WRITE_PREV_WRITE_FAILED 409 /* Previous buffered write failed. */
-#define PIE_HID_WRITE_PREV_WRITE_WRONG_NUMBER 410 /* Previous buffered write sent wrong number of bytes */
+#define PIE_HID_WRITE_PREV_WRITE_FAILED 409 /* Previous buffered write failed. This one was not sent; resubmit it */
+#define PIE_HID_WRITE_PREV_WRITE_WRONG_NUMBER 410 /* Previous buffered write sent wrong number of bytes. This one was not sent; resubmit it */
 #define PIE_HID_WRITE_TIMER_FAILED 411 /* timer failed */
 #define PIE_HID_WRITE_PREV_WRITE_UNABLE_TO_RELEASE_MUTEX 412 /* previous buffered write count not release mutex */
 #define PIE_HID_WRITE_BUFFER_FULL2 413 /* write buffer is full */
@@ -114,6 +126,15 @@ typedef enum {
 #define PIE_HID_ERRORCALLBACK_CANNOT_CREATE_ERROR_THREAD 803
 #define PIE_HID_ERRORCALLBACK_ERROR_THREAD_ALREADY_CREATED 1804
 
+// InitializePIE() errors
+#define PIE_HID_INIT_FAILED 901 /* Could not set up the USB library */
+
+// SetFeatureReportAsync() and GetFeatureReportAsync() errors
+#define PIE_HID_FEATURE_BAD_HANDLE 1001 /* Bad interface handle */
+#define PIE_HID_FEATURE_FAILED 1002 /* Feature report request failed */
+#define PIE_HID_FEATURE_QUEUE_FULL 1003 /* Too many feature requests outstanding */
+#define PIE_HID_FEATURE_BAD_LENGTH 1004 /* Report length out of range */
+
 
 
 typedef struct  _HID_ENUM_INFO  {
@@ -123,35 +144,89 @@ typedef struct  _HID_ENUM_INFO  {
     long    readSize;
     long    writeSize;
     char    DevicePath[256];
-    unsigned int   Handle;
+    unsigned int   Handle; /* the same while the device stays in the same port */
     unsigned int   Version;
     char   ManufacturerString[128];
     char   ProductString[128];
 } TEnumHIDInfo;
 
-#define MAX_XKEY_DEVICES		128
+#define MAX_XKEY_DEVICES		128 /* interfaces EnumeratePIE() returns at most */
 #define PI_VID					0x5F3
+#define MAX_RING_DEPTH			8192
+#define MAX_INPUT_TRANSFERS		32
+#define MAX_WRITE_QUEUE_DEPTH	16
+#define MAX_FEATURE_QUEUE_DEPTH	16
+
+typedef struct _PIE_SETUP_OPTIONS {
+    unsigned int   ringDepth;      /* reports buffered, power of two from 2; 0 for the default */
+    unsigned int   overflowPolicy; /* EOverflowPI */
+    unsigned int   inputTransfers; /* USB reads kept queued, up to MAX_INPUT_TRANSFERS; 0 for the default */
+    unsigned int   writeQueueDepth; /* WriteDataAsync() writes outstanding, up to MAX_WRITE_QUEUE_DEPTH; 0 for the default */
+    unsigned int   inputTimeout;   /* ms a USB read waits before it is resubmitted; 0 to wait forever (the default) */
+} TSetupOptions;
 
 typedef unsigned int (PIE_HID_CALL *PHIDDataEvent)(unsigned char *pData, unsigned int deviceID, unsigned int error);
+/* As PHIDDataEvent, with the CLOCK_MONOTONIC time in ns at which the
+   report's USB transfer completed. */
+typedef unsigned int (PIE_HID_CALL *PHIDDataEventEx)(unsigned char *pData, unsigned int deviceID, unsigned int error, unsigned long long timestamp);
+/* As PHIDDataEvent, with pMask holding pData XOR the previous report
+   received, so that set bits mark what changed. */
+typedef unsigned int (PIE_HID_CALL *PHIDDataEventDelta)(unsigned char *pData, unsigned char *pMask, unsigned int deviceID, unsigned int error);
+/* Called when the device is disconnected, on the interface's callback
+   thread (the one which calls the data callbacks), so it may call
+   CloseInterface(). */
 typedef unsigned int (PIE_HID_CALL *PHIDErrorEvent)( unsigned int deviceID,unsigned int status);
-
+/* Called when a WriteDataAsync() write completes, with 0, PIE_HID_WRITE_FAILED
+   or PIE_HID_WRITE_INCOMPLETE. Runs on the USB event thread; must not block.
+   The first such failure is also returned, once, by the next
+   WriteDataAsync() as PIE_HID_WRITE_PREV_WRITE_FAILED or
+   PIE_HID_WRITE_PREV_WRITE_WRONG_NUMBER; that call's data is not sent and
+   must be passed again. */
+typedef unsigned int (PIE_HID_CALL *PHIDWriteEvent)(unsigned int deviceID, unsigned int status);
+/* Called when a SetFeatureReportAsync() or GetFeatureReportAsync()
+   request completes, with 0 or PIE_HID_FEATURE_FAILED. For a get, pData
+   holds the report, starting with its ID, and length its size; for a set
+   pData is NULL and length the bytes sent. */
+typedef unsigned int (PIE_HID_CALL *PHIDFeatureEvent)(unsigned char *pData, int length, unsigned int deviceID, unsigned int status);
+
+unsigned int PIE_HID_CALL InitializePIE(void);
+void PIE_HID_CALL ShutdownPIE(void);
 void PIE_HID_CALL GetErrorString(int errNumb,char* EString,int size);
 void PIE_HID_CALL GetProductString(int Pid,char* EString);
 unsigned int PIE_HID_CALL EnumeratePIE(long VID, TEnumHIDInfo *info, long *count);
+unsigned int PIE_HID_CALL EnumeratePIEEx(long VID, TEnumHIDInfo *info, long maxCount, long *count);
 unsigned int PIE_HID_CALL GetXKeyVersion(long hnd);
 unsigned int PIE_HID_CALL SetupInterfaceEx(long hnd);
+unsigned int PIE_HID_CALL SetupInterfaceEx2(long hnd, const TSetupOptions *options);
 void  PIE_HID_CALL CloseInterface(long hnd);
 void  PIE_HID_CALL CleanupInterface(long hnd);
 unsigned int PIE_HID_CALL ReadData(long hnd, unsigned char *data);
 unsigned int PIE_HID_CALL BlockingReadData(long hnd, unsigned char *data, int maxMillis);
+unsigned int PIE_HID_CALL ReadDataEx(long hnd, unsigned char *data, unsigned long long *timestamp);
+unsigned int PIE_HID_CALL ReadDataDelta(long hnd, unsigned char *data, unsigned char *mask);
+unsigned int PIE_HID_CALL PeekData(long hnd, const unsigned char **ptr, int *len);
+unsigned int PIE_HID_CALL ReleaseData(long hnd);
+unsigned int PIE_HID_CALL BlockingReadDataEx(long hnd, unsigned char *data, int maxMillis, unsigned long long *timestamp);
+unsigned int PIE_HID_CALL ReadDataBatch(long hnd, unsigned char *data, int stride, int maxReports, int *count, int maxMillis);
+unsigned int PIE_HID_CALL WaitForAnyData(const long *handles, int n, int maxMillis, long *readyHandle);
 unsigned int PIE_HID_CALL WriteData(long hnd, unsigned char *data);
+unsigned int PIE_HID_CALL WriteDataAsync(long hnd, unsigned char *data);
 unsigned int PIE_HID_CALL FastWrite(long hnd, unsigned char *data);
+unsigned int PIE_HID_CALL SetFeatureReportAsync(long hnd, unsigned char *data, int length);
+unsigned int PIE_HID_CALL GetFeatureReportAsync(long hnd, unsigned char reportID, int length);
 unsigned int PIE_HID_CALL ReadLast(long hnd, unsigned char *data);
+unsigned int PIE_HID_CALL ReadCurrentState(long hnd, unsigned char *data);
 unsigned int PIE_HID_CALL ClearBuffer(long hnd);
+unsigned int PIE_HID_CALL GetOverflowCount(long hnd);
+int PIE_HID_CALL GetReadEventFd(long hnd);
 unsigned int PIE_HID_CALL GetReadLength(long hnd);
 unsigned int PIE_HID_CALL GetWriteLength(long hnd);
 unsigned int PIE_HID_CALL SetDataCallback(long hnd, PHIDDataEvent pDataEvent);
+unsigned int PIE_HID_CALL SetDataCallbackEx(long hnd, PHIDDataEventEx pDataEvent);
+unsigned int PIE_HID_CALL SetDataCallbackDelta(long hnd, PHIDDataEventDelta pDataEvent);
 unsigned int PIE_HID_CALL SetErrorCallback(long hnd, PHIDErrorEvent pErrorCall);
+unsigned int PIE_HID_CALL SetWriteCallback(long hnd, PHIDWriteEvent pWriteEvent);
+unsigned int PIE_HID_CALL SetFeatureCallback(long hnd, PHIDFeatureEvent pFeatureEvent);
 #ifdef _WIN32
 void PIE_HID_CALL DongleCheck2(int k0, int k1, int k2, int k3, int n0, int n1, int n2, int n3, int &r0, int &r1, int &r2, int &r3);
 #endif
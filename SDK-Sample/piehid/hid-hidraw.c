@@ -0,0 +1,1379 @@
+/*******************************************************
+ HIDAPI - Multi-Platform library for
+ communication with HID devices.
+
+ Linux hidraw Version
+
+ This backend talks to the kernel's /dev/hidraw* nodes
+ instead of claiming the USB interface with libusb, so
+ the kernel HID driver stays bound to the device. It is
+ built instead of hid-libusb.c when the PIEHID_USE_HIDRAW
+ CMake option is on.
+
+ At the discretion of the user of this library,
+ this software may be licensed under the terms of the
+ GNU Public License v3, a BSD-Style license, or the
+ original HIDAPI license as outlined in the LICENSE.txt,
+ LICENSE-gpl3.txt, LICENSE-bsd.txt, and LICENSE-orig.txt
+ files located at the root of the source distribution.
+ These files may also be found in the public source
+ code repository located at:
+        http://github.com/signal11/hidapi .
+********************************************************/
+
+/* C */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <locale.h>
+#include <errno.h>
+#include <wchar.h>
+#include <limits.h>
+
+/* Unix */
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/sysmacros.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <libgen.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+/* Linux */
+#include <linux/hidraw.h>
+#include <linux/input.h>
+
+#include "hidapi.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#ifdef DEBUG_PRINTF
+#define LOG(...) fprintf(stderr, __VA_ARGS__)
+#else
+#define LOG(...) do {} while (0)
+#endif
+
+/* The largest report the kernel will hand to or take from a hidraw node
+   (HID_MAX_BUFFER_SIZE). */
+#define MAX_REPORT_LENGTH 4096
+
+/* Size of an input report queue slot when the interrupt IN endpoint's
+   wMaxPacketSize can't be read from sysfs. */
+#define DEFAULT_INPUT_REPORT_LENGTH 64
+
+/* Writes from hid_write_async() which may be queued on a device at
+   once. */
+#define MAX_PENDING_WRITES 16
+
+/* Feature report requests from hid_send_feature_report_async() and
+   hid_get_feature_report_async() which may be queued on a device at
+   once. */
+#define MAX_PENDING_FEATURE_REQUESTS 16
+
+/* Both kinds share the writer thread's queue. */
+#define MAX_QUEUED_REQUESTS (MAX_PENDING_WRITES + MAX_PENDING_FEATURE_REQUESTS)
+
+/* Input reports received from the device and not yet read, for when
+   there is no input callback. When the queue is full the oldest report
+   is dropped, so it doesn't grow forever if the user never reads
+   anything from the device. Must be a power of two. */
+#define MAX_QUEUED_REPORTS 32
+
+struct input_report {
+	uint8_t *data; /* input_report_length bytes, allocated at open */
+	size_t len;
+	uint64_t timestamp;
+};
+
+enum request_type {
+	REQUEST_WRITE,
+	REQUEST_SET_FEATURE,
+	REQUEST_GET_FEATURE,
+};
+
+/* One hid_write_async(), hid_send_feature_report_async() or
+   hid_get_feature_report_async() waiting for the device's writer
+   thread. For a get, data is the buffer to read into, with the report
+   ID in front. */
+struct write_request {
+	enum request_type type;
+	unsigned char *data;
+	size_t length;
+	hid_write_callback callback;
+	hid_feature_callback feature_callback;
+	void *user_data;
+};
+
+
+struct hid_device_ {
+	/* The open /dev/hidraw* node. */
+	int device_handle;
+
+	/* The USB device's directory in sysfs, for the string getters.
+	   NULL if the device isn't on USB. */
+	char *usb_sysfs_path;
+
+	/* Whether blocking reads are used */
+	int blocking; /* boolean */
+
+	/* Read objects. The node is read by the shared event thread. */
+	pthread_mutex_t mutex; /* Protects input_reports and the write queue */
+	pthread_cond_t condition;
+	int shutdown_thread;
+	int disconnected; /* the input callback has been told, or will be */
+
+	/* Ring of received input reports, and the buffer their data
+	   points into. */
+	struct input_report input_reports[MAX_QUEUED_REPORTS];
+	uint8_t *input_report_data;
+	size_t input_report_length;
+	int first_input_report;
+	int num_input_reports;
+
+	/* Where input reports go instead of input_reports, if set. See
+	   hid_set_input_callback(). */
+	_Atomic(hid_input_callback) input_callback;
+	void *input_callback_data;
+
+	/* Queue of writes and feature requests from the *_async()
+	   functions, which the writer thread performs in order.
+	   writes_active and features_active count those of each kind
+	   queued plus the one being performed. Protected by mutex. */
+	struct write_request write_queue[MAX_QUEUED_REQUESTS];
+	int first_write;
+	int num_writes;
+	int writes_active;
+	int features_active;
+	int writer_started;
+	int writer_exit;
+	pthread_t writer_thread;
+};
+
+/* One thread reads every open device's node. It is started by the first
+   hid_open_path() and stopped by the last hid_close(). Devices are
+   added to and removed from its epoll set while it runs; the eventfd
+   wakes it to exit or to finish a pass (see event_thread_quiesce()). */
+static pthread_mutex_t event_thread_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t event_thread;
+static int event_thread_users = 0;
+static volatile int event_thread_exit = 0;
+static int epoll_fd = -1;
+static int wake_fd = -1;
+
+/* The event thread holds dispatch_lock while it handles the events from
+   one epoll_wait(), and counts the passes in dispatch_pass. */
+static pthread_mutex_t dispatch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dispatch_cond = PTHREAD_COND_INITIALIZER;
+static unsigned long dispatch_pass = 0;
+static int dispatch_running = 0;
+
+static int return_data(hid_device *dev, unsigned char *data, size_t length);
+
+/* Give each slot in the input report queue its buffer. Returns 0 on
+   success or -1 if there is not enough memory. */
+static int alloc_input_reports(hid_device *dev)
+{
+	int i;
+
+	dev->input_report_data = malloc(MAX_QUEUED_REPORTS * dev->input_report_length);
+	if (!dev->input_report_data)
+		return -1;
+	for (i = 0; i < MAX_QUEUED_REPORTS; i++)
+		dev->input_reports[i].data = dev->input_report_data + i * dev->input_report_length;
+
+	return 0;
+}
+
+static hid_device *new_hid_device(void)
+{
+	hid_device *dev = calloc(1, sizeof(hid_device));
+	dev->device_handle = -1;
+	dev->usb_sysfs_path = NULL;
+	dev->blocking = 1;
+	dev->shutdown_thread = 0;
+	dev->disconnected = 0;
+	dev->input_report_data = NULL;
+	dev->input_report_length = DEFAULT_INPUT_REPORT_LENGTH;
+	dev->first_input_report = 0;
+	dev->num_input_reports = 0;
+	atomic_init(&dev->input_callback, NULL);
+	dev->input_callback_data = NULL;
+	dev->first_write = 0;
+	dev->num_writes = 0;
+	dev->writes_active = 0;
+	dev->features_active = 0;
+	dev->writer_started = 0;
+	dev->writer_exit = 0;
+
+	pthread_mutex_init(&dev->mutex, NULL);
+	pthread_cond_init(&dev->condition, NULL);
+
+	return dev;
+}
+
+static void free_hid_device(hid_device *dev)
+{
+	/* Clean up the thread objects */
+	pthread_cond_destroy(&dev->condition);
+	pthread_mutex_destroy(&dev->mutex);
+
+	free(dev->input_report_data);
+	free(dev->usb_sysfs_path);
+
+	/* Free the device itself */
+	free(dev);
+}
+
+/* Get bytes from a HID Report Descriptor.
+   Only call with a num_bytes of 0, 1, 2, or 4. */
+static uint32_t get_bytes(uint8_t *rpt, size_t len, size_t num_bytes, size_t cur)
+{
+	/* Return if there aren't enough bytes. */
+	if (cur + num_bytes >= len)
+		return 0;
+
+	if (num_bytes == 0)
+		return 0;
+	else if (num_bytes == 1) {
+		return rpt[cur+1];
+	}
+	else if (num_bytes == 2) {
+		return (rpt[cur+2] * 256 + rpt[cur+1]);
+	}
+	else if (num_bytes == 4) {
+		return (rpt[cur+4] * 0x01000000 +
+		        rpt[cur+3] * 0x00010000 +
+		        rpt[cur+2] * 0x00000100 +
+		        rpt[cur+1] * 0x00000001);
+	}
+	else
+		return 0;
+}
+
+/* Retrieves the device's Usage Page and Usage from the report
+   descriptor. The algorithm is simple, as it just returns the first
+   Usage and Usage Page that it finds in the descriptor.
+   The return value is 0 on success and -1 on failure. */
+static int get_usage(uint8_t *report_descriptor, size_t size,
+                     unsigned short *usage_page, unsigned short *usage)
+{
+	size_t i = 0;
+	int size_code;
+	int data_len, key_size;
+	int usage_found = 0, usage_page_found = 0;
+
+	while (i < size) {
+		int key = report_descriptor[i];
+		int key_cmd = key & 0xfc;
+
+		if ((key & 0xf0) == 0xf0) {
+			/* This is a Long Item. The next byte contains the
+			   length of the data section (value) for this key.
+			   See the HID specification, version 1.11, section
+			   6.2.2.3, titled "Long Items." */
+			if (i+1 < size)
+				data_len = report_descriptor[i+1];
+			else
+				data_len = 0; /* malformed report */
+			key_size = 3;
+		}
+		else {
+			/* This is a Short Item. The bottom two bits of the
+			   key contain the size code for the data section
+			   (value) for this key.  Refer to the HID
+			   specification, version 1.11, section 6.2.2.2,
+			   titled "Short Items." */
+			size_code = key & 0x3;
+			data_len = (size_code == 3)? 4: size_code;
+			key_size = 1;
+		}
+
+		if (key_cmd == 0x4) {
+			*usage_page  = get_bytes(report_descriptor, size, data_len, i);
+			usage_page_found = 1;
+		}
+		if (key_cmd == 0x8) {
+			*usage = get_bytes(report_descriptor, size, data_len, i);
+			usage_found = 1;
+		}
+
+		if (usage_page_found && usage_found)
+			return 0; /* success */
+
+		/* Skip over this key and it's associated data */
+		i += data_len + key_size;
+	}
+
+	return -1; /* failure */
+}
+
+/* Read a sysfs attribute into buf, without the trailing newline.
+   Returns the length read, or -1 if the attribute can't be read. */
+static ssize_t read_sysfs(const char *dir, const char *attr, char *buf, size_t size)
+{
+	char path[PATH_MAX];
+	ssize_t len;
+	int fd;
+
+	if (snprintf(path, sizeof(path), "%s/%s", dir, attr) >= (int)sizeof(path))
+		return -1;
+	fd = open(path, O_RDONLY|O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	len = read(fd, buf, size-1);
+	close(fd);
+	if (len < 0)
+		return -1;
+
+	while (len > 0 && buf[len-1] == '\n')
+		len--;
+	buf[len] = '\0';
+
+	return len;
+}
+
+/* Read a sysfs attribute which holds a hex number, such as idVendor. */
+static int read_sysfs_hex(const char *dir, const char *attr, unsigned int *value)
+{
+	char buf[32];
+
+	if (read_sysfs(dir, attr, buf, sizeof(buf)) <= 0)
+		return -1;
+	*value = strtoul(buf, NULL, 16);
+
+	return 0;
+}
+
+/* This function returns a newly allocated wide string holding the
+   sysfs attribute, which the kernel has already converted from the
+   USB string descriptor to UTF-8. The returned string must be freed
+   by using free(). */
+static wchar_t *get_sysfs_string(const char *dir, const char *attr)
+{
+	char buf[512];
+	wchar_t *str;
+	size_t wlen;
+
+	if (!dir || read_sysfs(dir, attr, buf, sizeof(buf)) < 0)
+		return NULL;
+
+	wlen = mbstowcs(NULL, buf, 0);
+	if (wlen == (size_t)-1)
+		return NULL;
+	str = calloc(wlen+1, sizeof(wchar_t));
+	if (str)
+		mbstowcs(str, buf, wlen+1);
+
+	return str;
+}
+
+/* Find the sysfs directories behind a hidraw node. hid_dir is the HID
+   device, which has the uevent and report_descriptor. For a device on
+   USB, intf_dir is the USB interface above it and usb_dir the USB
+   device above that; otherwise they are left empty. Each buffer must
+   be PATH_MAX long. Returns 0 on success or -1 on failure. */
+static int get_sysfs_dirs(const char *class_dir, char *hid_dir, char *intf_dir, char *usb_dir)
+{
+	char link[PATH_MAX];
+	char buf[256];
+	unsigned int bus = 0;
+	char *p;
+
+	snprintf(link, sizeof(link), "%s/device", class_dir);
+	if (!realpath(link, hid_dir))
+		return -1;
+
+	intf_dir[0] = '\0';
+	usb_dir[0] = '\0';
+
+	/* HID_ID=0003:000005F3:00000405, with the bus type first. */
+	if (read_sysfs(hid_dir, "uevent", buf, sizeof(buf)) < 0)
+		return -1;
+	p = strstr(buf, "HID_ID=");
+	if (p)
+		bus = strtoul(p + strlen("HID_ID="), NULL, 16);
+
+	if (bus == BUS_USB) {
+		strcpy(intf_dir, hid_dir);
+		strcpy(intf_dir, dirname(intf_dir));
+		strcpy(usb_dir, intf_dir);
+		strcpy(usb_dir, dirname(usb_dir));
+	}
+
+	return 0;
+}
+
+/* The wMaxPacketSize of the interface's interrupt IN endpoint, which
+   bounds a single input report. Returns 0 if it can't be found. */
+static size_t get_input_report_length(const char *intf_dir)
+{
+	DIR *dir;
+	struct dirent *ent;
+	size_t length = 0;
+
+	dir = opendir(intf_dir);
+	if (!dir)
+		return 0;
+	while ((ent = readdir(dir)) != NULL) {
+		char ep_dir[PATH_MAX];
+		unsigned int address, size;
+
+		if (strncmp(ent->d_name, "ep_", 3) != 0)
+			continue;
+		if (snprintf(ep_dir, sizeof(ep_dir), "%s/%s", intf_dir, ent->d_name) >= (int)sizeof(ep_dir))
+			continue;
+		if (read_sysfs_hex(ep_dir, "bEndpointAddress", &address) < 0 ||
+		    read_sysfs_hex(ep_dir, "wMaxPacketSize", &size) < 0)
+			continue;
+		if ((address & 0x80) && (address & 0x7f) && size > length)
+			length = size & 0x7ff;
+	}
+	closedir(dir);
+
+	return length;
+}
+
+/* There is no library state to set up here beyond the locale, which
+   the strings from sysfs are converted with. */
+int HID_API_EXPORT hid_init(void)
+{
+	setlocale(LC_ALL,"");
+
+	return 0;
+}
+
+int HID_API_EXPORT hid_exit(void)
+{
+	return 0;
+}
+
+struct hid_device_info  HID_API_EXPORT *hid_enumerate(unsigned short vendor_id, unsigned short product_id)
+{
+	return hid_enumerate_ex(vendor_id, product_id, 0);
+}
+
+struct hid_device_info  HID_API_EXPORT *hid_enumerate_ex(unsigned short vendor_id, unsigned short product_id, int flags)
+{
+	if (vendor_id == 0x0 && product_id == 0x0)
+		return hid_enumerate_filtered(0x0, NULL, 0, flags);
+
+	return hid_enumerate_filtered(vendor_id, &product_id, 1, flags);
+}
+
+/* Whether a device's VID/PID pass the hid_enumerate_filtered()
+   arguments. */
+static int ids_match(unsigned short dev_vid, unsigned short dev_pid, unsigned short vendor_id, const unsigned short *product_ids, size_t num_product_ids)
+{
+	size_t i;
+
+	if (vendor_id != 0x0 && vendor_id != dev_vid)
+		return 0;
+	if (num_product_ids == 0)
+		return 1;
+	for (i = 0; i < num_product_ids; i++) {
+		if (product_ids[i] == dev_pid)
+			return 1;
+	}
+	return 0;
+}
+
+struct hid_device_info  HID_API_EXPORT *hid_enumerate_filtered(unsigned short vendor_id, const unsigned short *product_ids, size_t num_product_ids, int flags)
+{
+	DIR *dir;
+	struct dirent *ent;
+
+	struct hid_device_info *root = NULL; // return object
+	struct hid_device_info *cur_dev = NULL;
+
+	hid_init();
+
+	dir = opendir("/sys/class/hidraw");
+	if (!dir)
+		return NULL;
+	while ((ent = readdir(dir)) != NULL) {
+		char class_dir[PATH_MAX];
+		char hid_dir[PATH_MAX], intf_dir[PATH_MAX], usb_dir[PATH_MAX];
+		char dev_path[PATH_MAX];
+		char buf[256];
+		unsigned int dev_vid = 0, dev_pid = 0;
+		char *p;
+		struct hid_device_info *tmp;
+
+		if (strncmp(ent->d_name, "hidraw", 6) != 0)
+			continue;
+		snprintf(class_dir, sizeof(class_dir), "/sys/class/hidraw/%s", ent->d_name);
+		if (get_sysfs_dirs(class_dir, hid_dir, intf_dir, usb_dir) < 0)
+			continue;
+
+		/* The VID/PID are the second and third fields of HID_ID. */
+		if (read_sysfs(hid_dir, "uevent", buf, sizeof(buf)) < 0)
+			continue;
+		p = strstr(buf, "HID_ID=");
+		if (!p || sscanf(p, "HID_ID=%*x:%x:%x", &dev_vid, &dev_pid) != 2)
+			continue;
+
+		/* Check the VID/PID against the arguments */
+		if (!ids_match(dev_vid, dev_pid, vendor_id, product_ids, num_product_ids))
+			continue;
+
+		/* VID/PID match. Create the record. */
+		tmp = calloc(1, sizeof(struct hid_device_info));
+		if (cur_dev) {
+			cur_dev->next = tmp;
+		}
+		else {
+			root = tmp;
+		}
+		cur_dev = tmp;
+
+		/* Fill out the record */
+		snprintf(dev_path, sizeof(dev_path), "/dev/%s", ent->d_name);
+		cur_dev->next = NULL;
+		cur_dev->path = strdup(dev_path);
+		cur_dev->vendor_id = dev_vid;
+		cur_dev->product_id = dev_pid;
+		cur_dev->interface_number = -1;
+
+		if (usb_dir[0]) {
+			unsigned int value;
+
+			/* Strings, as the kernel read them when the device
+			   was plugged in. */
+			if (!(flags & HID_ENUMERATE_NO_STRINGS)) {
+				cur_dev->serial_number = get_sysfs_string(usb_dir, "serial");
+				cur_dev->manufacturer_string = get_sysfs_string(usb_dir, "manufacturer");
+				cur_dev->product_string = get_sysfs_string(usb_dir, "product");
+			}
+
+			/* Release Number */
+			if (read_sysfs_hex(usb_dir, "bcdDevice", &value) == 0)
+				cur_dev->release_number = value;
+
+			/* Interface Number */
+			if (read_sysfs_hex(intf_dir, "bInterfaceNumber", &value) == 0)
+				cur_dev->interface_number = value;
+		}
+		else if (!(flags & HID_ENUMERATE_NO_STRINGS)) {
+			/* Not USB. The kernel's name for it is all there is. */
+			char name[256];
+			if (read_sysfs(hid_dir, "uevent", buf, sizeof(buf)) >= 0 &&
+			    (p = strstr(buf, "HID_NAME=")) != NULL &&
+			    sscanf(p, "HID_NAME=%255[^\n]", name) == 1) {
+				size_t wlen = mbstowcs(NULL, name, 0);
+				if (wlen != (size_t)-1) {
+					cur_dev->product_string = calloc(wlen+1, sizeof(wchar_t));
+					if (cur_dev->product_string)
+						mbstowcs(cur_dev->product_string, name, wlen+1);
+				}
+			}
+		}
+
+		/* Usage Page and Usage. The kernel keeps a copy of the
+		   report descriptor, so unlike the libusb backend this
+		   doesn't have to touch the device. */
+		{
+			char path[PATH_MAX];
+			uint8_t data[MAX_REPORT_LENGTH];
+			ssize_t len;
+			int fd;
+
+			fd = -1;
+			if (snprintf(path, sizeof(path), "%s/report_descriptor", hid_dir) < (int)sizeof(path))
+				fd = open(path, O_RDONLY|O_CLOEXEC);
+			if (fd >= 0) {
+				len = read(fd, data, sizeof(data));
+				if (len > 0) {
+					unsigned short page=0, usage=0;
+					get_usage(data, len, &page, &usage);
+					cur_dev->usage_page = page;
+					cur_dev->usage = usage;
+				}
+				close(fd);
+			}
+		}
+	}
+	closedir(dir);
+
+	return root;
+}
+
+void  HID_API_EXPORT hid_free_enumeration(struct hid_device_info *devs)
+{
+	struct hid_device_info *d = devs;
+	while (d) {
+		struct hid_device_info *next = d->next;
+		free(d->path);
+		free(d->serial_number);
+		free(d->manufacturer_string);
+		free(d->product_string);
+		free(d);
+		d = next;
+	}
+}
+
+/* Hotplug events would need a udev monitor, which this backend doesn't
+   use, so applications fall back to polling hid_enumerate(). */
+int HID_API_EXPORT hid_hotplug_register(unsigned short vendor_id, unsigned short product_id, hid_hotplug_callback callback, void *user_data)
+{
+	return -1;
+}
+
+void HID_API_EXPORT hid_hotplug_deregister(void)
+{
+}
+
+hid_device * hid_open(unsigned short vendor_id, unsigned short product_id, wchar_t *serial_number)
+{
+	struct hid_device_info *devs, *cur_dev;
+	const char *path_to_open = NULL;
+	hid_device *handle = NULL;
+
+	devs = hid_enumerate(vendor_id, product_id);
+	cur_dev = devs;
+	while (cur_dev) {
+		if (cur_dev->vendor_id == vendor_id &&
+		    cur_dev->product_id == product_id) {
+			if (serial_number) {
+				if (cur_dev->serial_number &&
+				    wcscmp(serial_number, cur_dev->serial_number) == 0) {
+					path_to_open = cur_dev->path;
+					break;
+				}
+			}
+			else {
+				path_to_open = cur_dev->path;
+				break;
+			}
+		}
+		cur_dev = cur_dev->next;
+	}
+
+	if (path_to_open) {
+		/* Open the device */
+		handle = hid_open_path(path_to_open);
+	}
+
+	hid_free_enumeration(devs);
+
+	return handle;
+}
+
+/* CLOCK_MONOTONIC now, in nanoseconds. */
+static uint64_t monotonic_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Tell the input callback that the device has gone, and wake any
+   threads waiting in hid_read_timeout(). Setting disconnected and
+   loading the callback under the mutex means that exactly one of this
+   and hid_set_input_callback() does so. */
+static void report_disconnect(hid_device *dev, uint64_t timestamp)
+{
+	hid_input_callback callback = NULL;
+
+	pthread_mutex_lock(&dev->mutex);
+	if (!dev->disconnected && !dev->shutdown_thread)
+		callback = atomic_load(&dev->input_callback);
+	dev->disconnected = 1;
+	dev->shutdown_thread = 1;
+	pthread_cond_broadcast(&dev->condition);
+	pthread_mutex_unlock(&dev->mutex);
+
+	if (callback)
+		callback(dev, NULL, -1, timestamp, dev->input_callback_data);
+}
+
+/* Called on the event thread when the device's node is readable. */
+static void read_report(hid_device *dev)
+{
+	static uint8_t buf[MAX_REPORT_LENGTH]; /* only the event thread */
+	hid_input_callback callback;
+	ssize_t len;
+
+	len = read(dev->device_handle, buf, sizeof(buf));
+
+	/* Stamp the report as early as possible, before any copying. */
+	uint64_t timestamp = monotonic_ns();
+
+	if (len < 0) {
+		if (errno == EINTR || errno == EAGAIN)
+			return;
+		/* ENODEV, or EIO once the device is gone. Stop
+		   watching it. */
+		epoll_ctl(epoll_fd, EPOLL_CTL_DEL, dev->device_handle, NULL);
+		report_disconnect(dev, timestamp);
+		return;
+	}
+
+	callback = atomic_load_explicit(&dev->input_callback, memory_order_acquire);
+	if (callback) {
+		/* Hand the report straight to the callback. */
+		callback(dev, buf, len, timestamp, dev->input_callback_data);
+		return;
+	}
+
+	pthread_mutex_lock(&dev->mutex);
+
+	/* A callback may have been set since we looked. If so,
+	   hid_set_input_callback() has already passed it everything in the
+	   queue, so this report can go straight to it too. */
+	callback = atomic_load_explicit(&dev->input_callback, memory_order_acquire);
+	if (callback) {
+		pthread_mutex_unlock(&dev->mutex);
+		callback(dev, buf, len, timestamp, dev->input_callback_data);
+		return;
+	}
+
+	/* Drop the oldest report if the queue is full. */
+	if (dev->num_input_reports == MAX_QUEUED_REPORTS) {
+		dev->first_input_report = (dev->first_input_report + 1) & (MAX_QUEUED_REPORTS-1);
+		dev->num_input_reports--;
+	}
+
+	/* Copy the new report into the next free slot. */
+	struct input_report *rpt = &dev->input_reports[
+		(dev->first_input_report + dev->num_input_reports) & (MAX_QUEUED_REPORTS-1)];
+	if ((size_t)len > dev->input_report_length)
+		len = dev->input_report_length;
+	memcpy(rpt->data, buf, len);
+	rpt->len = len;
+	rpt->timestamp = timestamp;
+
+	if (dev->num_input_reports++ == 0) {
+		/* The queue was empty. */
+		pthread_cond_signal(&dev->condition);
+	}
+	pthread_mutex_unlock(&dev->mutex);
+}
+
+static void *event_thread_main(void *param)
+{
+	struct epoll_event events[16];
+
+	/* Read from every device which has a report waiting. */
+	while (!event_thread_exit) {
+		int i, n;
+
+		n = epoll_wait(epoll_fd, events, sizeof(events)/sizeof(events[0]), -1);
+		if (n < 0 && errno != EINTR) {
+			/* There was an error. Break out of this loop. */
+			LOG("epoll_wait() failed: %d\n", errno);
+			break;
+		}
+
+		pthread_mutex_lock(&dispatch_lock);
+		for (i = 0; i < n; i++) {
+			hid_device *dev = events[i].data.ptr;
+			if (dev) {
+				read_report(dev);
+			}
+			else {
+				uint64_t count;
+				if (read(wake_fd, &count, sizeof(count)) < 0)
+					LOG("eventfd read failed: %d\n", errno);
+			}
+		}
+		dispatch_pass++;
+		pthread_cond_broadcast(&dispatch_cond);
+		pthread_mutex_unlock(&dispatch_lock);
+	}
+
+	pthread_mutex_lock(&dispatch_lock);
+	dispatch_running = 0;
+	pthread_cond_broadcast(&dispatch_cond);
+	pthread_mutex_unlock(&dispatch_lock);
+
+	return NULL;
+}
+
+/* Wake the event thread out of epoll_wait(). */
+static void event_thread_wake(void)
+{
+	uint64_t one = 1;
+	if (write(wake_fd, &one, sizeof(one)) < 0)
+		LOG("eventfd write failed: %d\n", errno);
+}
+
+/* Wait for the event thread to finish the pass it is on, if any. Once a
+   device has been taken out of the epoll set this means the thread is
+   done with it, as any events it had already been handed for it were
+   in that pass. */
+static void event_thread_quiesce(void)
+{
+	unsigned long pass;
+
+	pthread_mutex_lock(&dispatch_lock);
+	pass = dispatch_pass;
+	event_thread_wake();
+	while (dispatch_pass == pass && dispatch_running)
+		pthread_cond_wait(&dispatch_cond, &dispatch_lock);
+	pthread_mutex_unlock(&dispatch_lock);
+}
+
+/* Take a reference on the event thread, starting it if necessary.
+   Returns 0 on success or -1 if the thread could not be created. */
+static int event_thread_get(void)
+{
+	struct epoll_event ev;
+	int res = 0;
+
+	pthread_mutex_lock(&event_thread_lock);
+	if (event_thread_users == 0) {
+		event_thread_exit = 0;
+		epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		wake_fd = eventfd(0, EFD_CLOEXEC|EFD_NONBLOCK);
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.ptr = NULL;
+		if (epoll_fd < 0 || wake_fd < 0 ||
+		    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev) < 0)
+			res = -1;
+		dispatch_running = 1;
+		if (res == 0 &&
+		    pthread_create(&event_thread, NULL, event_thread_main, NULL) != 0)
+			res = -1;
+		if (res < 0) {
+			dispatch_running = 0;
+			if (epoll_fd >= 0)
+				close(epoll_fd);
+			if (wake_fd >= 0)
+				close(wake_fd);
+			epoll_fd = wake_fd = -1;
+		}
+	}
+	if (res == 0)
+		event_thread_users++;
+	pthread_mutex_unlock(&event_thread_lock);
+
+	return res;
+}
+
+/* Drop a reference on the event thread, stopping it when the last
+   device has been closed. */
+static void event_thread_put(void)
+{
+	pthread_mutex_lock(&event_thread_lock);
+	if (--event_thread_users == 0) {
+		event_thread_exit = 1;
+		event_thread_wake();
+		pthread_join(event_thread, NULL);
+		close(epoll_fd);
+		close(wake_fd);
+		epoll_fd = wake_fd = -1;
+	}
+	pthread_mutex_unlock(&event_thread_lock);
+}
+
+
+hid_device * HID_API_EXPORT hid_open_path(const char *path)
+{
+	return hid_open_path_ex(path, 0, 0);
+}
+
+/* There are no transfers to keep queued or resubmit here; the kernel
+   buffers input reports on the node itself, and the event thread sleeps
+   in epoll_wait() until one arrives. So num_input_transfers and
+   input_timeout are ignored. */
+hid_device * HID_API_EXPORT hid_open_path_ex(const char *path, int num_input_transfers, int input_timeout)
+{
+	hid_device *dev = NULL;
+	struct stat st;
+	struct epoll_event ev;
+	char class_dir[PATH_MAX];
+	char hid_dir[PATH_MAX], intf_dir[PATH_MAX], usb_dir[PATH_MAX];
+	size_t length;
+
+	hid_init();
+
+	dev = new_hid_device();
+
+	// OPEN HERE //
+	dev->device_handle = open(path, O_RDWR|O_CLOEXEC);
+	if (dev->device_handle < 0) {
+		LOG("can't open device\n");
+		goto err;
+	}
+
+	/* Find the node's sysfs directories through its device number,
+	   so that any name for the node (a udev symlink, say) works. */
+	if (fstat(dev->device_handle, &st) == 0 && S_ISCHR(st.st_mode)) {
+		snprintf(class_dir, sizeof(class_dir), "/sys/dev/char/%u:%u",
+			major(st.st_rdev), minor(st.st_rdev));
+		if (get_sysfs_dirs(class_dir, hid_dir, intf_dir, usb_dir) == 0 && usb_dir[0]) {
+			dev->usb_sysfs_path = strdup(usb_dir);
+			length = get_input_report_length(intf_dir);
+			if (length > 0)
+				dev->input_report_length = length;
+		}
+	}
+
+	if (alloc_input_reports(dev) < 0 || event_thread_get() < 0) {
+		LOG("can't start reading\n");
+		goto err_close;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = dev;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, dev->device_handle, &ev) < 0) {
+		LOG("can't watch device\n");
+		event_thread_put();
+		goto err_close;
+	}
+
+	return dev;
+
+err_close:
+	close(dev->device_handle);
+err:
+	free_hid_device(dev);
+	return NULL;
+}
+
+/* Opening the node is as direct as it gets, so there is nothing in the
+   entry beyond its path to use. */
+hid_device * HID_API_EXPORT hid_open_info(const struct hid_device_info *info, int num_input_transfers, int input_timeout)
+{
+	return hid_open_path_ex(info->path, num_input_transfers, input_timeout);
+}
+
+
+/* The report ID goes to the kernel as the first byte, 0x0 for devices
+   with only a single report, so the data is written as it is. */
+int HID_API_EXPORT hid_write(hid_device *dev, const unsigned char *data, size_t length)
+{
+	ssize_t res;
+
+	res = write(dev->device_handle, data, length);
+	if (res < 0)
+		return -1;
+
+	return res;
+}
+
+static void *writer_thread_main(void *param)
+{
+	hid_device *dev = param;
+
+	pthread_mutex_lock(&dev->mutex);
+	for (;;) {
+		struct write_request req;
+		int res = -1;
+
+		while (!dev->num_writes && !dev->writer_exit)
+			pthread_cond_wait(&dev->condition, &dev->mutex);
+		if (!dev->num_writes)
+			break;
+
+		/* Take the oldest request, and write it without the mutex
+		   so that more can be queued meanwhile. */
+		req = dev->write_queue[dev->first_write];
+		dev->first_write = (dev->first_write + 1) % MAX_QUEUED_REQUESTS;
+		dev->num_writes--;
+		pthread_mutex_unlock(&dev->mutex);
+
+		switch (req.type) {
+		case REQUEST_WRITE:
+			res = hid_write(dev, req.data, req.length);
+			break;
+		case REQUEST_SET_FEATURE:
+			res = hid_send_feature_report(dev, req.data, req.length);
+			break;
+		case REQUEST_GET_FEATURE:
+			res = hid_get_feature_report(dev, req.data, req.length);
+			break;
+		}
+
+		/* Give up the place first, so that the callback can queue
+		   the next request, and let hid_close() know once the last
+		   one is done. hid_close() still can't get past joining this
+		   thread before the callback returns. */
+		pthread_mutex_lock(&dev->mutex);
+		if (req.type == REQUEST_WRITE)
+			dev->writes_active--;
+		else
+			dev->features_active--;
+		pthread_cond_broadcast(&dev->condition);
+		pthread_mutex_unlock(&dev->mutex);
+
+		if (req.type == REQUEST_WRITE) {
+			if (req.callback)
+				req.callback(dev, res, req.user_data);
+		}
+		else if (req.feature_callback) {
+			req.feature_callback(dev,
+				req.type == REQUEST_GET_FEATURE && res >= 0? req.data: NULL,
+				res, req.user_data);
+		}
+		free(req.data);
+
+		pthread_mutex_lock(&dev->mutex);
+	}
+	pthread_mutex_unlock(&dev->mutex);
+
+	return NULL;
+}
+
+/* Add a request to the writer thread's queue, starting the thread if
+   this is the first. Takes ownership of data on success. */
+static int queue_request(hid_device *dev, struct write_request *new_req)
+{
+	int res = -1;
+	int *active = new_req->type == REQUEST_WRITE?
+		&dev->writes_active: &dev->features_active;
+	int limit = new_req->type == REQUEST_WRITE?
+		MAX_PENDING_WRITES: MAX_PENDING_FEATURE_REQUESTS;
+
+	pthread_mutex_lock(&dev->mutex);
+	if (dev->shutdown_thread || *active >= limit)
+		goto unlock;
+	if (!dev->writer_started) {
+		if (pthread_create(&dev->writer_thread, NULL, writer_thread_main, dev) != 0)
+			goto unlock;
+		dev->writer_started = 1;
+	}
+
+	dev->write_queue[(dev->first_write + dev->num_writes) % MAX_QUEUED_REQUESTS] = *new_req;
+	dev->num_writes++;
+	(*active)++;
+	pthread_cond_broadcast(&dev->condition);
+	res = 0;
+
+unlock:
+	pthread_mutex_unlock(&dev->mutex);
+	return res;
+}
+
+/* A write to a hidraw node blocks until the device has the report, so
+   the writes are done in order on a thread of the device's own, which
+   is started by the first one. */
+int HID_API_EXPORT hid_write_async(hid_device *dev, const unsigned char *data, size_t length, hid_write_callback callback, void *user_data)
+{
+	struct write_request req;
+	unsigned char *buf;
+
+	/* As in hid-libusb, report ID 0 alone is nothing to send. */
+	if (length == 0 || (data[0] == 0x0 && length <= 1))
+		return -1;
+	buf = malloc(length);
+	if (!buf)
+		return -1;
+	memcpy(buf, data, length);
+
+	req.type = REQUEST_WRITE;
+	req.data = buf;
+	req.length = length;
+	req.callback = callback;
+	req.feature_callback = NULL;
+	req.user_data = user_data;
+	if (queue_request(dev, &req) < 0) {
+		free(buf);
+		return -1;
+	}
+	return 0;
+}
+
+/* The feature report ioctls block too, so these go through the same
+   queue as hid_write_async(). */
+int HID_API_EXPORT hid_send_feature_report_async(hid_device *dev, const unsigned char *data, size_t length, hid_feature_callback callback, void *user_data)
+{
+	struct write_request req;
+	unsigned char *buf = malloc(length);
+
+	if (!buf)
+		return -1;
+	memcpy(buf, data, length);
+
+	req.type = REQUEST_SET_FEATURE;
+	req.data = buf;
+	req.length = length;
+	req.callback = NULL;
+	req.feature_callback = callback;
+	req.user_data = user_data;
+	if (queue_request(dev, &req) < 0) {
+		free(buf);
+		return -1;
+	}
+	return 0;
+}
+
+int HID_API_EXPORT hid_get_feature_report_async(hid_device *dev, unsigned char report_number, size_t length, hid_feature_callback callback, void *user_data)
+{
+	struct write_request req;
+	unsigned char *buf;
+
+	if (length == 0)
+		return -1;
+	buf = calloc(1, length);
+	if (!buf)
+		return -1;
+	buf[0] = report_number;
+
+	req.type = REQUEST_GET_FEATURE;
+	req.data = buf;
+	req.length = length;
+	req.callback = NULL;
+	req.feature_callback = callback;
+	req.user_data = user_data;
+	if (queue_request(dev, &req) < 0) {
+		free(buf);
+		return -1;
+	}
+	return 0;
+}
+
+/* Helper function, to simplify hid_read().
+   This should be called with dev->mutex locked. */
+static int return_data(hid_device *dev, unsigned char *data, size_t length)
+{
+	/* Copy the data out of the first report in the queue (rpt) into
+	   the return buffer (data), and remove it from the queue. */
+	struct input_report *rpt = &dev->input_reports[dev->first_input_report];
+	size_t len = (length < rpt->len)? length: rpt->len;
+	if (len > 0)
+		memcpy(data, rpt->data, len);
+	dev->first_input_report = (dev->first_input_report + 1) & (MAX_QUEUED_REPORTS-1);
+	dev->num_input_reports--;
+	return len;
+}
+
+static void cleanup_mutex(void *param)
+{
+	hid_device *dev = param;
+	pthread_mutex_unlock(&dev->mutex);
+}
+
+
+int HID_API_EXPORT hid_read_timeout(hid_device *dev, unsigned char *data, size_t length, int milliseconds)
+{
+	int bytes_read = -1;
+
+	pthread_mutex_lock(&dev->mutex);
+	pthread_cleanup_push(&cleanup_mutex, dev);
+
+	/* There's an input report queued up. Return it. */
+	if (dev->num_input_reports) {
+		/* Return the first one */
+		bytes_read = return_data(dev, data, length);
+		goto ret;
+	}
+
+	if (dev->shutdown_thread) {
+		/* This means the device has been disconnected.
+		   An error code of -1 should be returned. */
+		bytes_read = -1;
+		goto ret;
+	}
+
+	if (milliseconds == -1) {
+		/* Blocking */
+		while (!dev->num_input_reports && !dev->shutdown_thread) {
+			pthread_cond_wait(&dev->condition, &dev->mutex);
+		}
+		if (dev->num_input_reports) {
+			bytes_read = return_data(dev, data, length);
+		}
+	}
+	else if (milliseconds > 0) {
+		/* Non-blocking, but called with timeout. */
+		int res;
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += milliseconds / 1000;
+		ts.tv_nsec += (milliseconds % 1000) * 1000000;
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+
+		while (!dev->num_input_reports && !dev->shutdown_thread) {
+			res = pthread_cond_timedwait(&dev->condition, &dev->mutex, &ts);
+			if (res == 0) {
+				if (dev->num_input_reports) {
+					bytes_read = return_data(dev, data, length);
+					break;
+				}
+
+				/* If we're here, there was a spurious wake up
+				   or the device went away. Run the loop again
+				   (ie: don't break). */
+			}
+			else if (res == ETIMEDOUT) {
+				/* Timed out. */
+				bytes_read = 0;
+				break;
+			}
+			else {
+				/* Error. */
+				bytes_read = -1;
+				break;
+			}
+		}
+	}
+	else {
+		/* Purely non-blocking */
+		bytes_read = 0;
+	}
+
+ret:
+	pthread_mutex_unlock(&dev->mutex);
+	pthread_cleanup_pop(0);
+
+	return bytes_read;
+}
+
+int HID_API_EXPORT hid_read(hid_device *dev, unsigned char *data, size_t length)
+{
+	return hid_read_timeout(dev, data, length, dev->blocking ? -1 : 0);
+}
+
+int HID_API_EXPORT hid_set_nonblocking(hid_device *dev, int nonblock)
+{
+	dev->blocking = !nonblock;
+
+	return 0;
+}
+
+void HID_API_EXPORT hid_set_input_callback(hid_device *dev, hid_input_callback callback, void *user_data)
+{
+	pthread_mutex_lock(&dev->mutex);
+
+	/* Pass on anything which was queued before the callback was set, so
+	   that it arrives ahead of the reports read_report() delivers. */
+	while (callback && dev->num_input_reports) {
+		struct input_report *rpt = &dev->input_reports[dev->first_input_report];
+		callback(dev, rpt->data, rpt->len, rpt->timestamp, user_data);
+		dev->first_input_report = (dev->first_input_report + 1) & (MAX_QUEUED_REPORTS-1);
+		dev->num_input_reports--;
+	}
+
+	/* Nothing more is coming if the device has already gone. */
+	if (callback && dev->disconnected)
+		callback(dev, NULL, -1, monotonic_ns(), user_data);
+
+	dev->input_callback_data = user_data;
+	atomic_store_explicit(&dev->input_callback, callback, memory_order_release);
+
+	pthread_mutex_unlock(&dev->mutex);
+}
+
+
+int HID_API_EXPORT hid_send_feature_report(hid_device *dev, const unsigned char *data, size_t length)
+{
+	int res;
+
+	res = ioctl(dev->device_handle, HIDIOCSFEATURE(length), data);
+	if (res < 0)
+		return -1;
+
+	return res;
+}
+
+int HID_API_EXPORT hid_get_feature_report(hid_device *dev, unsigned char *data, size_t length)
+{
+	int res;
+
+	/* data[0] holds the report ID going in, and the kernel leaves it
+	   there in front of the report. */
+	res = ioctl(dev->device_handle, HIDIOCGFEATURE(length), data);
+	if (res < 0)
+		return -1;
+
+	return res;
+}
+
+
+void HID_API_EXPORT hid_close(hid_device *dev)
+{
+	if (!dev)
+		return;
+
+	/* Stop reading the node, and wait for the event thread to be done
+	   with the device. */
+	pthread_mutex_lock(&dev->mutex);
+	dev->shutdown_thread = 1;
+	pthread_cond_broadcast(&dev->condition);
+	pthread_mutex_unlock(&dev->mutex);
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, dev->device_handle, NULL);
+	event_thread_quiesce();
+
+	/* Let queued writes and feature requests finish, so that the last
+	   thing the application sent reaches the device, then stop the
+	   writer thread. */
+	pthread_mutex_lock(&dev->mutex);
+	while (dev->writes_active || dev->features_active)
+		pthread_cond_wait(&dev->condition, &dev->mutex);
+	dev->writer_exit = 1;
+	pthread_cond_broadcast(&dev->condition);
+	pthread_mutex_unlock(&dev->mutex);
+	if (dev->writer_started)
+		pthread_join(dev->writer_thread, NULL);
+
+	/* Close the handle */
+	close(dev->device_handle);
+
+	event_thread_put();
+
+	free_hid_device(dev);
+}
+
+
+int HID_API_EXPORT_CALL hid_get_manufacturer_string(hid_device *dev, wchar_t *string, size_t maxlen)
+{
+	return hid_get_indexed_string(dev, 1, string, maxlen);
+}
+
+int HID_API_EXPORT_CALL hid_get_product_string(hid_device *dev, wchar_t *string, size_t maxlen)
+{
+	return hid_get_indexed_string(dev, 2, string, maxlen);
+}
+
+int HID_API_EXPORT_CALL hid_get_serial_number_string(hid_device *dev, wchar_t *string, size_t maxlen)
+{
+	return hid_get_indexed_string(dev, 3, string, maxlen);
+}
+
+/* sysfs only has the three strings named in the device descriptor, so
+   string_index here is 1 for the manufacturer, 2 for the product and 3
+   for the serial number, whatever the device's own indexes are. Any
+   other index fails. */
+int HID_API_EXPORT_CALL hid_get_indexed_string(hid_device *dev, int string_index, wchar_t *string, size_t maxlen)
+{
+	static const char *attrs[] = { NULL, "manufacturer", "product", "serial" };
+	wchar_t *str;
+
+	if (string_index < 1 || string_index > 3)
+		return -1;
+
+	str = get_sysfs_string(dev->usb_sysfs_path, attrs[string_index]);
+	if (str) {
+		wcsncpy(string, str, maxlen);
+		string[maxlen-1] = L'\0';
+		free(str);
+		return 0;
+	}
+	else
+		return -1;
+}
+
+
+HID_API_EXPORT const wchar_t * HID_API_CALL  hid_error(hid_device *dev)
+{
+	return NULL;
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -35,9 +35,12 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
+#include <sys/time.h>
 #include <sys/utsname.h>
 #include <fcntl.h>
+#include <time.h>
 #include <pthread.h>
+#include <stdatomic.h>
 
 /* GNU / LibUSB */
 #include "libusb.h"
@@ -63,11 +66,41 @@ Linux/libusb HIDAPI programs are encouraged to use the interface number
 instead to differentiate between interfaces on a composite HID device. */
 /*#define INVASIVE_GET_USAGE*/
 
-/* Linked List of input reports received from the device. */
+/* Interrupt IN transfers kept submitted on each device, so that the
+   endpoint always has one queued while a completion is being handled.
+   See hid_open_path_ex(). */
+#define DEFAULT_INPUT_TRANSFERS 4
+#define MAX_INPUT_TRANSFERS 32
+
+/* How long the event thread sleeps in libusb between checks that it
+   should exit, in seconds. Where libusb_interrupt_event_handler() can
+   wake it there is nothing to check, so it sleeps for as long as poll()
+   allows; otherwise it looks once a second. */
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000105
+#define EVENT_LOOP_TIMEOUT (24*60*60)
+#else
+#define EVENT_LOOP_TIMEOUT 1
+#endif
+
+/* Writes from hid_write_async() which may be in flight on a device at
+   once. */
+#define MAX_PENDING_WRITES 16
+
+/* Feature report requests from hid_send_feature_report_async() and
+   hid_get_feature_report_async() which may be in flight on a device at
+   once. */
+#define MAX_PENDING_FEATURE_REQUESTS 16
+
+/* Input reports received from the device and not yet read, for when
+   there is no input callback. When the queue is full the oldest report
+   is dropped, so it doesn't grow forever if the user never reads
+   anything from the device. Must be a power of two. */
+#define MAX_QUEUED_REPORTS 32
+
 struct input_report {
-	uint8_t *data;
+	uint8_t *data; /* input_ep_max_packet_size bytes, allocated at open */
 	size_t len;
-	struct input_report *next;
+	uint64_t timestamp;
 };
 
 
@@ -91,23 +124,113 @@ struct hid_device_ {
 	/* Whether blocking reads are used */
 	int blocking; /* boolean */
 	
-	/* Read thread objects */
-	pthread_t thread;
-	pthread_mutex_t mutex; /* Protects input_reports */
+	/* Read objects. The transfers are serviced by the shared event
+	   thread. */
+	pthread_mutex_t mutex; /* Protects input_reports and resubmission */
 	pthread_cond_t condition;
-	pthread_barrier_t barrier; /* Ensures correct startup sequence */
 	int shutdown_thread;
-	struct libusb_transfer *transfer;
+	int disconnected; /* the input callback has been told, or will be */
+	int transfers_active; /* submitted, or their callback is running */
+	int num_transfers;
+	struct libusb_transfer *transfers[MAX_INPUT_TRANSFERS];
+	unsigned int input_timeout; /* ms, or 0 for none */
+
+	/* Transfers submitted by hid_write_async() whose callbacks have
+	   not yet run. Protected by mutex. */
+	struct libusb_transfer *write_transfers[MAX_PENDING_WRITES];
+	int writes_active;
+
+	/* The same, for feature report requests. */
+	struct libusb_transfer *feature_transfers[MAX_PENDING_FEATURE_REQUESTS];
+	int features_active;
+
+	/* Ring of received input reports, and the buffer their data
+	   points into. */
+	struct input_report input_reports[MAX_QUEUED_REPORTS];
+	uint8_t *input_report_data;
+	int first_input_report;
+	int num_input_reports;
+
+	/* Where input reports go instead of input_reports, if set. See
+	   hid_set_input_callback(). */
+	_Atomic(hid_input_callback) input_callback;
+	void *input_callback_data;
+};
+
+/* The library's own libusb context, so that its events are handled
+   apart from those of anything else in the process which uses libusb.
+   See hid_init(). */
+static pthread_mutex_t context_lock = PTHREAD_MUTEX_INITIALIZER;
+static libusb_context *usb_context = NULL;
+
+/* Strings read from a device, so that each physical device is only
+   asked for them once. Entries are found by where the device is on the
+   bus, and dropped by hid_enumerate() once it has gone. Protected by
+   strings_lock, as is string_converter, the UTF-16LE to wchar_t
+   converter which hid_init() opens for every string to share. */
+enum cached_string {
+	STRING_MANUFACTURER,
+	STRING_PRODUCT,
+	STRING_SERIAL,
+	NUM_CACHED_STRINGS
+};
 
-	/* List of received input reports. */
-	struct input_report *input_reports;
+struct string_cache_entry {
+	uint8_t bus;
+	uint8_t address;
+	uint16_t vendor_id;
+	uint16_t product_id;
+	int fetched; /* lang and strings have been read */
+	uint16_t lang;
+	wchar_t *strings[NUM_CACHED_STRINGS];
+	struct string_cache_entry *next;
 };
 
-static int initialized = 0;
+static pthread_mutex_t strings_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct string_cache_entry *string_cache = NULL;
+static iconv_t string_converter = (iconv_t)-1;
+
+/* The USB language code for the current locale, from hid_init(). */
+static uint16_t locale_language = 0;
+
+/* One thread handles libusb events for every open device. It is started
+   by the first hid_open_path() and stopped by the last hid_close(). */
+static pthread_mutex_t event_thread_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t event_thread;
+static int event_thread_users = 0;
+static volatile int event_thread_exit = 0;
+
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000102
+/* The hid_hotplug_register() callback, if any. hotplug_lock is held
+   while it is called, so that hid_hotplug_deregister() can wait for it
+   to return. hotplug_setup_lock serializes registering and
+   deregistering, and protects hotplug_registered. */
+static pthread_mutex_t hotplug_lock = PTHREAD_MUTEX_INITIALIZER;
+static hid_hotplug_callback hotplug_callback = NULL;
+static void *hotplug_user_data;
+static pthread_mutex_t hotplug_setup_lock = PTHREAD_MUTEX_INITIALIZER;
+static int hotplug_registered = 0;
+static libusb_hotplug_callback_handle hotplug_handle;
+#endif
 
 uint16_t get_usb_code_for_current_locale(void);
 static int return_data(hid_device *dev, unsigned char *data, size_t length);
 
+/* Give each slot in the input report queue its buffer. Returns 0 on
+   success or -1 if there is not enough memory. */
+static int alloc_input_reports(hid_device *dev)
+{
+	int i;
+
+	dev->input_report_data = malloc(MAX_QUEUED_REPORTS * dev->input_ep_max_packet_size);
+	if (!dev->input_report_data)
+		return -1;
+	for (i = 0; i < MAX_QUEUED_REPORTS; i++)
+		dev->input_reports[i].data = dev->input_report_data + i * dev->input_ep_max_packet_size;
+
+	return 0;
+}
+
 static hid_device *new_hid_device(void)
 {
 	hid_device *dev = calloc(1, sizeof(hid_device));
@@ -121,12 +244,20 @@ static hid_device *new_hid_device(void)
 	dev->serial_index = 0;
 	dev->blocking = 1;
 	dev->shutdown_thread = 0;
-	dev->transfer = NULL;
-	dev->input_reports = NULL;
+	dev->disconnected = 0;
+	dev->transfers_active = 0;
+	dev->num_transfers = 0;
+	dev->input_timeout = 0;
+	dev->writes_active = 0;
+	dev->features_active = 0;
+	dev->input_report_data = NULL;
+	dev->first_input_report = 0;
+	dev->num_input_reports = 0;
+	atomic_init(&dev->input_callback, NULL);
+	dev->input_callback_data = NULL;
 	
 	pthread_mutex_init(&dev->mutex, NULL);
 	pthread_cond_init(&dev->condition, NULL);
-	pthread_barrier_init(&dev->barrier, NULL, 2);
 	
 	return dev;
 }
@@ -134,10 +265,11 @@ static hid_device *new_hid_device(void)
 static void free_hid_device(hid_device *dev)
 {
 	/* Clean up the thread objects */
-	pthread_barrier_destroy(&dev->barrier);
 	pthread_cond_destroy(&dev->condition);
 	pthread_mutex_destroy(&dev->mutex);
 
+	free(dev->input_report_data);
+
 	/* Free the device itself */
 	free(dev);
 }
@@ -253,26 +385,10 @@ static int get_usage(uint8_t *report_descriptor, size_t size,
 #endif // INVASIVE_GET_USAGE
 
 
-/* Get the first language the device says it reports. This comes from
-   USB string #0. */
-static uint16_t get_first_language(libusb_device_handle *dev)
-{
-	uint16_t buf[32];
-	int len;
-	
-	/* Get the string from libusb. */
-	len = libusb_get_string_descriptor(dev,
-			0x0, /* String ID */
-			0x0, /* Language */
-			(unsigned char*)buf,
-			sizeof(buf));
-	if (len < 4)
-		return 0x0;
-	
-	return buf[1]; // First two bytes are len and descriptor type.
-}
-
-static int is_language_supported(libusb_device_handle *dev, uint16_t lang)
+/* Work out which language to read a device's strings in: the one for
+   the current locale if the device has it, and otherwise the first
+   one it lists. The list is USB string #0. */
+static uint16_t get_device_language(libusb_device_handle *dev)
 {
 	uint16_t buf[32];
 	int len;
@@ -287,22 +403,21 @@ static int is_language_supported(libusb_device_handle *dev, uint16_t lang)
 	if (len < 4)
 		return 0x0;
 	
-	
 	len /= 2; /* language IDs are two-bytes each. */
 	/* Start at index 1 because there are two bytes of protocol data. */
 	for (i = 1; i < len; i++) {
-		if (buf[i] == lang)
-			return 1;
+		if (buf[i] == locale_language)
+			return buf[i];
 	}
 
-	return 0;
+	return buf[1]; // First two bytes are len and descriptor type.
 }
 
 
 /* This function returns a newly allocated wide string containing the USB
-   device string numbered by the index. The returned string must be freed
-   by using free(). */
-static wchar_t *get_usb_string(libusb_device_handle *dev, uint8_t idx)
+   device string numbered by the index, in language lang. The returned
+   string must be freed by using free(). */
+static wchar_t *get_usb_string(libusb_device_handle *dev, uint16_t lang, uint8_t idx)
 {
 	char buf[512];
 	int len;
@@ -310,234 +425,516 @@ static wchar_t *get_usb_string(libusb_device_handle *dev, uint8_t idx)
 	wchar_t wbuf[256];
 
 	/* iconv variables */
-	iconv_t ic;
 	size_t inbytes;
 	size_t outbytes;
 	size_t res;
 	char *inptr;
 	char *outptr;
 
-	/* Determine which language to use. */
-	uint16_t lang;
-	lang = get_usb_code_for_current_locale();
-	if (!is_language_supported(dev, lang))
-		lang = get_first_language(dev);
-		
 	/* Get the string from libusb. */
 	len = libusb_get_string_descriptor(dev,
 			idx,
 			lang,
 			(unsigned char*)buf,
 			sizeof(buf));
-	if (len < 0)
-		return NULL;
-	
-	buf[sizeof(buf)-1] = '\0';
-	
-	if (len+1 < sizeof(buf))
-		buf[len+1] = '\0';
-	
-	/* Initialize iconv. */
-	ic = iconv_open("UTF-32", "UTF-16");
-	if (ic == (iconv_t)-1)
+	if (len < 2)
 		return NULL;
 	
-	/* Convert to UTF-32 (wchar_t on glibc systems).
+	/* Convert to wchar_t, with the converter hid_init() opened.
 	   Skip the first character (2-bytes). */
 	inptr = buf+2;
 	inbytes = len-2;
 	outptr = (char*) wbuf;
-	outbytes = sizeof(wbuf);
-	res = iconv(ic, &inptr, &inbytes, &outptr, &outbytes);
+	outbytes = sizeof(wbuf) - sizeof(wbuf[0]);
+	pthread_mutex_lock(&strings_lock);
+	if (string_converter == (iconv_t)-1) {
+		pthread_mutex_unlock(&strings_lock);
+		return NULL;
+	}
+	res = iconv(string_converter, &inptr, &inbytes, &outptr, &outbytes);
+	iconv(string_converter, NULL, NULL, NULL, NULL); /* reset for the next */
+	pthread_mutex_unlock(&strings_lock);
 	if (res == (size_t)-1)
-		goto err;
+		return NULL;
 
 	/* Write the terminating NULL. */
-	wbuf[sizeof(wbuf)/sizeof(wbuf[0])-1] = 0x00000000;
-	if (outbytes >= sizeof(wbuf[0]))
-		*((wchar_t*)outptr) = 0x00000000;
+	*((wchar_t*)outptr) = 0x00000000;
 	
 	/* Allocate and copy the string. */
-	str = wcsdup(wbuf+1);
+	str = wcsdup(wbuf);
 
-err:
-	iconv_close(ic);
-	
 	return str;
 }
 
+/* Find the cache entry for usb_dev, making one if create is set.
+   This should be called with strings_lock locked. */
+static struct string_cache_entry *find_cached_strings(libusb_device *usb_dev, const struct libusb_device_descriptor *desc, int create)
+{
+	struct string_cache_entry *e;
+	uint8_t bus = libusb_get_bus_number(usb_dev);
+	uint8_t address = libusb_get_device_address(usb_dev);
+
+	for (e = string_cache; e; e = e->next) {
+		if (e->bus == bus && e->address == address &&
+		    e->vendor_id == desc->idVendor && e->product_id == desc->idProduct)
+			return e;
+	}
+	if (!create)
+		return NULL;
+
+	e = calloc(1, sizeof(*e));
+	if (!e)
+		return NULL;
+	e->bus = bus;
+	e->address = address;
+	e->vendor_id = desc->idVendor;
+	e->product_id = desc->idProduct;
+	e->next = string_cache;
+	string_cache = e;
+
+	return e;
+}
+
+static void free_cached_strings(struct string_cache_entry *e)
+{
+	int i;
+
+	for (i = 0; i < NUM_CACHED_STRINGS; i++)
+		free(e->strings[i]);
+	free(e);
+}
+
+/* Forget the strings of any device which is no longer in devs, the
+   list from libusb_get_device_list(), so that the cache only holds
+   what is plugged in. */
+static void prune_cached_strings(libusb_device **devs)
+{
+	struct string_cache_entry **p, *e;
+
+	pthread_mutex_lock(&strings_lock);
+	p = &string_cache;
+	while ((e = *p) != NULL) {
+		int i, found = 0;
+		for (i = 0; devs[i] && !found; i++) {
+			found = libusb_get_bus_number(devs[i]) == e->bus &&
+			        libusb_get_device_address(devs[i]) == e->address;
+		}
+		if (found) {
+			p = &e->next;
+		}
+		else {
+			*p = e->next;
+			free_cached_strings(e);
+		}
+	}
+	pthread_mutex_unlock(&strings_lock);
+}
+
+/* Fill out with newly allocated copies of the strings named in the
+   device descriptor (manufacturer, product and serial number), leaving
+   NULL for any the device doesn't have. Until they have all been read
+   once, the device's language and all three are read, through handle if
+   it isn't NULL and otherwise by opening the device; after that they
+   come from the cache. The strings must be freed by using free(). */
+static void get_device_strings(libusb_device *usb_dev, libusb_device_handle *handle, wchar_t *out[NUM_CACHED_STRINGS])
+{
+	struct libusb_device_descriptor desc;
+	struct string_cache_entry *e;
+	wchar_t *strings[NUM_CACHED_STRINGS] = { NULL };
+	uint8_t indexes[NUM_CACHED_STRINGS];
+	libusb_device_handle *opened = NULL;
+	uint16_t lang;
+	int complete = 1;
+	int i;
+
+	for (i = 0; i < NUM_CACHED_STRINGS; i++)
+		out[i] = NULL;
+
+	libusb_get_device_descriptor(usb_dev, &desc);
+	indexes[STRING_MANUFACTURER] = desc.iManufacturer;
+	indexes[STRING_PRODUCT] = desc.iProduct;
+	indexes[STRING_SERIAL] = desc.iSerialNumber;
+	if (!indexes[STRING_MANUFACTURER] && !indexes[STRING_PRODUCT] && !indexes[STRING_SERIAL])
+		return;
+
+	pthread_mutex_lock(&strings_lock);
+	e = find_cached_strings(usb_dev, &desc, 0);
+	if (e && e->fetched) {
+		for (i = 0; i < NUM_CACHED_STRINGS; i++) {
+			if (e->strings[i])
+				out[i] = wcsdup(e->strings[i]);
+		}
+		pthread_mutex_unlock(&strings_lock);
+		return;
+	}
+	pthread_mutex_unlock(&strings_lock);
+
+	/* Not cached yet. Read them without the lock, as this talks to the
+	   device. */
+	if (!handle) {
+		if (libusb_open(usb_dev, &opened) < 0)
+			return;
+		handle = opened;
+	}
+	lang = get_device_language(handle);
+	for (i = 0; i < NUM_CACHED_STRINGS; i++) {
+		if (indexes[i] > 0) {
+			strings[i] = get_usb_string(handle, lang, indexes[i]);
+			if (!strings[i])
+				complete = 0;
+		}
+	}
+	if (opened)
+		libusb_close(opened);
+
+	/* Another thread may have cached them meanwhile, in which case
+	   its copies win. A string which couldn't be read, say because
+	   the device was busy, is not cached, so that the next call tries
+	   again. */
+	pthread_mutex_lock(&strings_lock);
+	e = find_cached_strings(usb_dev, &desc, complete);
+	if (e && !e->fetched && complete) {
+		for (i = 0; i < NUM_CACHED_STRINGS; i++) {
+			e->strings[i] = strings[i];
+			strings[i] = NULL;
+		}
+		e->lang = lang;
+		e->fetched = 1;
+	}
+	for (i = 0; i < NUM_CACHED_STRINGS; i++) {
+		if (e && e->fetched) {
+			if (e->strings[i])
+				out[i] = wcsdup(e->strings[i]);
+		}
+		else if (strings[i])
+			out[i] = wcsdup(strings[i]);
+	}
+	pthread_mutex_unlock(&strings_lock);
+
+	for (i = 0; i < NUM_CACHED_STRINGS; i++)
+		free(strings[i]);
+}
+
+/* This function returns a newly allocated copy of one of the strings
+   from get_device_strings(), or NULL if the device doesn't have it. The
+   returned string must be freed by using free(). */
+static wchar_t *get_device_string(libusb_device *usb_dev, libusb_device_handle *handle, enum cached_string which)
+{
+	wchar_t *strings[NUM_CACHED_STRINGS];
+	int i;
+
+	get_device_strings(usb_dev, handle, strings);
+	for (i = 0; i < NUM_CACHED_STRINGS; i++) {
+		if (i != (int) which)
+			free(strings[i]);
+	}
+
+	return strings[which];
+}
+
+/* The language to read the device's other strings in, from the cache if
+   get_device_strings() has already worked it out. */
+static uint16_t get_cached_language(libusb_device_handle *handle)
+{
+	libusb_device *usb_dev = libusb_get_device(handle);
+	struct libusb_device_descriptor desc;
+	struct string_cache_entry *e;
+	uint16_t lang = 0;
+
+	int cached = 0;
+
+	libusb_get_device_descriptor(usb_dev, &desc);
+	pthread_mutex_lock(&strings_lock);
+	e = find_cached_strings(usb_dev, &desc, 0);
+	if (e && e->fetched) {
+		lang = e->lang;
+		cached = 1;
+	}
+	pthread_mutex_unlock(&strings_lock);
+
+	if (!cached)
+		lang = get_device_language(handle);
+
+	return lang;
+}
+
+/* The path is bus-port.port...:interface, as the kernel names USB
+   interfaces. Unlike the device address it depends only on where the
+   device is plugged in, so it is the same when the device is unplugged
+   and plugged back in. */
 static char *make_path(libusb_device *dev, int interface_number)
 {
 	char str[64];
-	snprintf(str, sizeof(str), "%04x:%04x:%02x",
+	int len;
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000102
+	uint8_t ports[7]; /* the most USB allows */
+	int num_ports, i;
+
+	len = snprintf(str, sizeof(str), "%d", libusb_get_bus_number(dev));
+	num_ports = libusb_get_port_numbers(dev, ports, sizeof(ports));
+	for (i = 0; i < num_ports; i++)
+		len += snprintf(str + len, sizeof(str) - len, "%c%d",
+			i == 0? '-': '.', ports[i]);
+#else
+	len = snprintf(str, sizeof(str), "%d@%d",
 		libusb_get_bus_number(dev),
-		libusb_get_device_address(dev),
-		interface_number);
+		libusb_get_device_address(dev));
+#endif
+	snprintf(str + len, sizeof(str) - len, ":%d", interface_number);
 	str[sizeof(str)-1] = '\0';
 	
 	return strdup(str);
 }
 
-struct hid_device_info  HID_API_EXPORT *hid_enumerate(unsigned short vendor_id, unsigned short product_id)
+int HID_API_EXPORT hid_init(void)
 {
-	libusb_device **devs;
-	libusb_device *dev;
-	libusb_device_handle *handle;
-	ssize_t num_devs;
-	int i = 0;
-	
-	struct hid_device_info *root = NULL; // return object
-	struct hid_device_info *cur_dev = NULL;
-	
-	setlocale(LC_ALL,"");
-	
-	if (!initialized) {
-		libusb_init(NULL);
-		initialized = 1;
+	int res = 0;
+
+	/* Under the lock, so that two threads calling this at once don't
+	   both create a context. */
+	pthread_mutex_lock(&context_lock);
+	if (!usb_context) {
+		setlocale(LC_ALL,"");
+		locale_language = get_usb_code_for_current_locale();
+		if (libusb_init(&usb_context) < 0) {
+			usb_context = NULL;
+			res = -1;
+		}
+		pthread_mutex_lock(&strings_lock);
+		if (res == 0 && string_converter == (iconv_t)-1)
+			string_converter = iconv_open("WCHAR_T", "UTF-16LE");
+		pthread_mutex_unlock(&strings_lock);
 	}
-	
-	num_devs = libusb_get_device_list(NULL, &devs);
-	if (num_devs < 0)
-		return NULL;
-	while ((dev = devs[i++]) != NULL) {
-		struct libusb_device_descriptor desc;
-		struct libusb_config_descriptor *conf_desc = NULL;
-		int j, k;
-		int interface_num = 0;
+	pthread_mutex_unlock(&context_lock);
 
-		int res = libusb_get_device_descriptor(dev, &desc);
-		unsigned short dev_vid = desc.idVendor;
-		unsigned short dev_pid = desc.idProduct;
-		
-		/* HID's are defined at the interface level. */
-		if (desc.bDeviceClass != LIBUSB_CLASS_PER_INTERFACE)
-			continue;
+	return res;
+}
 
-		res = libusb_get_active_config_descriptor(dev, &conf_desc);
-		if (res < 0)
-			libusb_get_config_descriptor(dev, 0, &conf_desc);
-		if (conf_desc) {
-			for (j = 0; j < conf_desc->bNumInterfaces; j++) {
-				const struct libusb_interface *intf = &conf_desc->interface[j];
-				for (k = 0; k < intf->num_altsetting; k++) {
-					const struct libusb_interface_descriptor *intf_desc;
-					intf_desc = &intf->altsetting[k];
-					if (intf_desc->bInterfaceClass == LIBUSB_CLASS_HID) {
-						interface_num = intf_desc->bInterfaceNumber;
+int HID_API_EXPORT hid_exit(void)
+{
+	/* The hotplug callback keeps the event thread running. */
+	hid_hotplug_deregister();
 
-						/* Check the VID/PID against the arguments */
-						if ((vendor_id == 0x0 && product_id == 0x0) ||
-						    (vendor_id == dev_vid && product_id == dev_pid)) {
-							struct hid_device_info *tmp;
+	pthread_mutex_lock(&context_lock);
+	if (usb_context) {
+		libusb_exit(usb_context);
+		usb_context = NULL;
+	}
 
-							/* VID/PID match. Create the record. */
-							tmp = calloc(1, sizeof(struct hid_device_info));
-							if (cur_dev) {
-								cur_dev->next = tmp;
-							}
-							else {
-								root = tmp;
-							}
-							cur_dev = tmp;
-							
-							/* Fill out the record */
-							cur_dev->next = NULL;
-							cur_dev->path = make_path(dev, interface_num);
-							
-							res = libusb_open(dev, &handle);
+	pthread_mutex_lock(&strings_lock);
+	while (string_cache) {
+		struct string_cache_entry *next = string_cache->next;
+		free_cached_strings(string_cache);
+		string_cache = next;
+	}
+	if (string_converter != (iconv_t)-1) {
+		iconv_close(string_converter);
+		string_converter = (iconv_t)-1;
+	}
+	pthread_mutex_unlock(&strings_lock);
+	pthread_mutex_unlock(&context_lock);
 
-							if (res >= 0) {
-								/* Serial Number */
-								if (desc.iSerialNumber > 0)
-									cur_dev->serial_number =
-										get_usb_string(handle, desc.iSerialNumber);
-
-								/* Manufacturer and Product strings */
-								if (desc.iManufacturer > 0)
-									cur_dev->manufacturer_string =
-										get_usb_string(handle, desc.iManufacturer);
-								if (desc.iProduct > 0)
-									cur_dev->product_string =
-										get_usb_string(handle, desc.iProduct);
+	return 0;
+}
+
+struct hid_device_info  HID_API_EXPORT *hid_enumerate(unsigned short vendor_id, unsigned short product_id)
+{
+	return hid_enumerate_ex(vendor_id, product_id, 0);
+}
 
+struct hid_device_info  HID_API_EXPORT *hid_enumerate_ex(unsigned short vendor_id, unsigned short product_id, int flags)
+{
+	if (vendor_id == 0x0 && product_id == 0x0)
+		return hid_enumerate_filtered(0x0, NULL, 0, flags);
+
+	return hid_enumerate_filtered(vendor_id, &product_id, 1, flags);
+}
+
+/* Whether a device's VID/PID pass the hid_enumerate_filtered()
+   arguments. */
+static int ids_match(unsigned short dev_vid, unsigned short dev_pid, unsigned short vendor_id, const unsigned short *product_ids, size_t num_product_ids)
+{
+	size_t i;
+
+	if (vendor_id != 0x0 && vendor_id != dev_vid)
+		return 0;
+	if (num_product_ids == 0)
+		return 1;
+	for (i = 0; i < num_product_ids; i++) {
+		if (product_ids[i] == dev_pid)
+			return 1;
+	}
+	return 0;
+}
+
+/* Append a record for each of dev's HID interfaces to the list ending
+   at tail, if the device matches the hid_enumerate_filtered() arguments,
+   and return the new end of the list. */
+static struct hid_device_info **append_device_infos(libusb_device *dev, unsigned short vendor_id, const unsigned short *product_ids, size_t num_product_ids, int flags, struct hid_device_info **tail)
+{
 #ifdef INVASIVE_GET_USAGE
-							/*
-							This section is removed because it is too
-							invasive on the system. Getting a Usage Page
-							and Usage requires parsing the HID Report
-							descriptor. Getting a HID Report descriptor
-							involves claiming the interface. Claiming the
-							interface involves detaching the kernel driver.
-							Detaching the kernel driver is hard on the system
-							because it will unclaim interfaces (if another
-							app has them claimed) and the re-attachment of
-							the driver will sometimes change /dev entry names.
-							It is for these reasons that this section is
-							#if 0. For composite devices, use the interface
-							field in the hid_device_info struct to distinguish
-							between interfaces. */
-								int detached = 0;
-								unsigned char data[256];
-							
-								/* Usage Page and Usage */
-								res = libusb_kernel_driver_active(handle, interface_num);
-								if (res == 1) {
-									res = libusb_detach_kernel_driver(handle, interface_num);
-									if (res < 0)
-										LOG("Couldn't detach kernel driver, even though a kernel driver was attached.");
-									else
-										detached = 1;
-								}
-								res = libusb_claim_interface(handle, interface_num);
-								if (res >= 0) {
-									/* Get the HID Report Descriptor. */
-									res = libusb_control_transfer(handle, LIBUSB_ENDPOINT_IN|LIBUSB_RECIPIENT_INTERFACE, LIBUSB_REQUEST_GET_DESCRIPTOR, (LIBUSB_DT_REPORT << 8)|interface_num, 0, data, sizeof(data), 5000);
-									if (res >= 0) {
-										unsigned short page=0, usage=0;
-										/* Parse the usage and usage page
-										   out of the report descriptor. */
-										get_usage(data, res,  &page, &usage);
-										cur_dev->usage_page = page;
-										cur_dev->usage = usage;
-									}
-									else
-										LOG("libusb_control_transfer() for getting the HID report failed with %d\n", res);
-
-									/* Release the interface */
-									res = libusb_release_interface(handle, interface_num);
-									if (res < 0)
-										LOG("Can't release the interface.\n");
-								}
-								else
-									LOG("Can't claim interface %d\n", res);
-
-								/* Re-attach kernel driver if necessary. */
-								if (detached) {
-									res = libusb_attach_kernel_driver(handle, interface_num);
-									if (res < 0)
-										LOG("Couldn't re-attach kernel driver.\n");
-								}
-#endif /*******************/
+	libusb_device_handle *handle;
+#endif
+	struct hid_device_info *cur_dev;
+	struct libusb_device_descriptor desc;
+	struct libusb_config_descriptor *conf_desc = NULL;
+	int j, k;
+	int interface_num = 0;
+
+	int res = libusb_get_device_descriptor(dev, &desc);
+	unsigned short dev_vid = desc.idVendor;
+	unsigned short dev_pid = desc.idProduct;
+	
+	/* Check the VID/PID against the arguments first. libusb keeps the
+	   device descriptor in memory, so a device which doesn't match is
+	   never talked to. */
+	if (res < 0 || !ids_match(dev_vid, dev_pid, vendor_id, product_ids, num_product_ids))
+		return tail;
+
+	/* HID's are defined at the interface level. */
+	if (desc.bDeviceClass != LIBUSB_CLASS_PER_INTERFACE)
+		return tail;
+
+	res = libusb_get_active_config_descriptor(dev, &conf_desc);
+	if (res < 0)
+		libusb_get_config_descriptor(dev, 0, &conf_desc);
+	if (conf_desc) {
+		for (j = 0; j < conf_desc->bNumInterfaces; j++) {
+			const struct libusb_interface *intf = &conf_desc->interface[j];
+			for (k = 0; k < intf->num_altsetting; k++) {
+				const struct libusb_interface_descriptor *intf_desc;
+				intf_desc = &intf->altsetting[k];
+				if (intf_desc->bInterfaceClass == LIBUSB_CLASS_HID) {
+					interface_num = intf_desc->bInterfaceNumber;
+
+					struct hid_device_info *tmp;
+
+					/* Create the record. */
+					tmp = calloc(1, sizeof(struct hid_device_info));
+					*tail = tmp;
+					tail = &tmp->next;
+					cur_dev = tmp;
+					
+					/* Fill out the record */
+					cur_dev->next = NULL;
+					cur_dev->path = make_path(dev, interface_num);
+					cur_dev->device = libusb_ref_device(dev);
+					
+					/* Serial Number, Manufacturer and Product
+					   strings, all read with one open of the
+					   device by the first enumeration which
+					   sees it. */
+					if (!(flags & HID_ENUMERATE_NO_STRINGS)) {
+						wchar_t *strings[NUM_CACHED_STRINGS];
+
+						get_device_strings(dev, NULL, strings);
+						cur_dev->serial_number = strings[STRING_SERIAL];
+						cur_dev->manufacturer_string = strings[STRING_MANUFACTURER];
+						cur_dev->product_string = strings[STRING_PRODUCT];
+					}
 
-								libusb_close(handle);
+#ifdef INVASIVE_GET_USAGE
+					res = libusb_open(dev, &handle);
+					if (res >= 0) {
+					/*
+					This section is removed because it is too
+					invasive on the system. Getting a Usage Page
+					and Usage requires parsing the HID Report
+					descriptor. Getting a HID Report descriptor
+					involves claiming the interface. Claiming the
+					interface involves detaching the kernel driver.
+					Detaching the kernel driver is hard on the system
+					because it will unclaim interfaces (if another
+					app has them claimed) and the re-attachment of
+					the driver will sometimes change /dev entry names.
+					It is for these reasons that this section is
+					#if 0. For composite devices, use the interface
+					field in the hid_device_info struct to distinguish
+					between interfaces. */
+						int detached = 0;
+						unsigned char data[256];
+					
+						/* Usage Page and Usage */
+						res = libusb_kernel_driver_active(handle, interface_num);
+						if (res == 1) {
+							res = libusb_detach_kernel_driver(handle, interface_num);
+							if (res < 0)
+								LOG("Couldn't detach kernel driver, even though a kernel driver was attached.");
+							else
+								detached = 1;
+						}
+						res = libusb_claim_interface(handle, interface_num);
+						if (res >= 0) {
+							/* Get the HID Report Descriptor. */
+							res = libusb_control_transfer(handle, LIBUSB_ENDPOINT_IN|LIBUSB_RECIPIENT_INTERFACE, LIBUSB_REQUEST_GET_DESCRIPTOR, (LIBUSB_DT_REPORT << 8)|interface_num, 0, data, sizeof(data), 5000);
+							if (res >= 0) {
+								unsigned short page=0, usage=0;
+								/* Parse the usage and usage page
+								   out of the report descriptor. */
+								get_usage(data, res,  &page, &usage);
+								cur_dev->usage_page = page;
+								cur_dev->usage = usage;
 							}
-							/* VID/PID */
-							cur_dev->vendor_id = dev_vid;
-							cur_dev->product_id = dev_pid;
+							else
+								LOG("libusb_control_transfer() for getting the HID report failed with %d\n", res);
 
-							/* Release Number */
-							cur_dev->release_number = desc.bcdDevice;
-							
-							/* Interface Number */
-							cur_dev->interface_number = interface_num;
+							/* Release the interface */
+							res = libusb_release_interface(handle, interface_num);
+							if (res < 0)
+								LOG("Can't release the interface.\n");
 						}
+						else
+							LOG("Can't claim interface %d\n", res);
+
+						/* Re-attach kernel driver if necessary. */
+						if (detached) {
+							res = libusb_attach_kernel_driver(handle, interface_num);
+							if (res < 0)
+								LOG("Couldn't re-attach kernel driver.\n");
+						}
+
+						libusb_close(handle);
 					}
-				} /* altsettings */
-			} /* interfaces */
-			libusb_free_config_descriptor(conf_desc);
-		}
+#endif /*******************/
+
+					/* VID/PID */
+					cur_dev->vendor_id = dev_vid;
+					cur_dev->product_id = dev_pid;
+
+					/* Release Number */
+					cur_dev->release_number = desc.bcdDevice;
+					
+					/* Interface Number */
+					cur_dev->interface_number = interface_num;
+				}
+			} /* altsettings */
+		} /* interfaces */
+		libusb_free_config_descriptor(conf_desc);
 	}
 
+	return tail;
+}
+
+struct hid_device_info  HID_API_EXPORT *hid_enumerate_filtered(unsigned short vendor_id, const unsigned short *product_ids, size_t num_product_ids, int flags)
+{
+	libusb_device **devs;
+	libusb_device *dev;
+	ssize_t num_devs;
+	int i = 0;
+	
+	struct hid_device_info *root = NULL; // return object
+	struct hid_device_info **tail = &root;
+	
+	if (hid_init() < 0)
+		return NULL;
+	
+	num_devs = libusb_get_device_list(usb_context, &devs);
+	if (num_devs < 0)
+		return NULL;
+	while ((dev = devs[i++]) != NULL)
+		tail = append_device_infos(dev, vendor_id, product_ids, num_product_ids, flags, tail);
+
+	prune_cached_strings(devs);
 	libusb_free_device_list(devs, 1);
 
 	return root;
@@ -552,6 +949,8 @@ void  HID_API_EXPORT hid_free_enumeration(struct hid_device_info *devs)
 		free(d->serial_number);
 		free(d->manufacturer_string);
 		free(d->product_string);
+		if (d->device)
+			libusb_unref_device(d->device);
 		free(d);
 		d = next;
 	}
@@ -592,51 +991,123 @@ hid_device * hid_open(unsigned short vendor_id, unsigned short product_id, wchar
 	return handle;
 }
 
+/* Called on the event thread when one of the device's transfers will
+   not be submitted again, because of hid_close() or a disconnect. */
+static void transfer_done(hid_device *dev)
+{
+	/* Wake hid_close(), and any threads which are waiting on data (in
+	   hid_read_timeout()). Do this under a mutex to make sure that a
+	   thread which is about to go to sleep waiting on the condition
+	   actually will go to sleep before the condition is signaled. */
+	pthread_mutex_lock(&dev->mutex);
+	dev->shutdown_thread = 1;
+	dev->transfers_active--;
+	pthread_cond_broadcast(&dev->condition);
+	pthread_mutex_unlock(&dev->mutex);
+}
+
+/* Tell the input callback that the device has gone. Every transfer
+   fails once it has, but only the first one counts. Setting
+   disconnected and loading the callback under the mutex means that
+   exactly one of this and hid_set_input_callback() does so. */
+static void report_disconnect(hid_device *dev, uint64_t timestamp)
+{
+	hid_input_callback callback = NULL;
+
+	pthread_mutex_lock(&dev->mutex);
+	if (!dev->disconnected)
+		callback = atomic_load(&dev->input_callback);
+	dev->disconnected = 1;
+	dev->shutdown_thread = 1;
+	pthread_mutex_unlock(&dev->mutex);
+
+	if (callback)
+		callback(dev, NULL, -1, timestamp, dev->input_callback_data);
+}
+
+/* Submit the transfer again, unless hid_close() has been called. This
+   is done under the mutex so that hid_close() either sees the transfer
+   submitted, and cancels it, or is seen here. */
+static void resubmit_transfer(struct libusb_transfer *transfer, uint64_t timestamp)
+{
+	hid_device *dev = transfer->user_data;
+	int closing;
+	int res = LIBUSB_ERROR_OTHER;
+
+	pthread_mutex_lock(&dev->mutex);
+	closing = dev->shutdown_thread;
+	if (!closing)
+		res = libusb_submit_transfer(transfer);
+	pthread_mutex_unlock(&dev->mutex);
+
+	if (res < 0) {
+		if (!closing)
+			report_disconnect(dev, timestamp);
+		transfer_done(dev);
+	}
+}
+
+/* CLOCK_MONOTONIC now, in nanoseconds. */
+static uint64_t monotonic_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
 static void read_callback(struct libusb_transfer *transfer)
 {
 	hid_device *dev = transfer->user_data;
+	hid_input_callback callback = atomic_load_explicit(&dev->input_callback, memory_order_acquire);
 	
-	if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+	/* Stamp the report as early as possible, before any copying. */
+	uint64_t timestamp = monotonic_ns();
+	
+	if (transfer->status == LIBUSB_TRANSFER_COMPLETED && callback) {
+		/* Hand the report straight to the callback. */
+		callback(dev, transfer->buffer, transfer->actual_length, timestamp, dev->input_callback_data);
+	}
+	else if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+
+		pthread_mutex_lock(&dev->mutex);
+
+		/* A callback may have been set since we looked. If so,
+		   hid_set_input_callback() has already passed it everything
+		   in the queue, so this report can go straight to it too. */
+		callback = atomic_load_explicit(&dev->input_callback, memory_order_acquire);
+		if (callback) {
+			pthread_mutex_unlock(&dev->mutex);
+			callback(dev, transfer->buffer, transfer->actual_length, timestamp, dev->input_callback_data);
+			resubmit_transfer(transfer, timestamp);
+			return;
+		}
+
+		/* Drop the oldest report if the queue is full. */
+		if (dev->num_input_reports == MAX_QUEUED_REPORTS) {
+			dev->first_input_report = (dev->first_input_report + 1) & (MAX_QUEUED_REPORTS-1);
+			dev->num_input_reports--;
+		}
 
-		struct input_report *rpt = malloc(sizeof(*rpt));
-		rpt->data = malloc(transfer->actual_length);
+		/* Copy the new report into the next free slot. */
+		struct input_report *rpt = &dev->input_reports[
+			(dev->first_input_report + dev->num_input_reports) & (MAX_QUEUED_REPORTS-1)];
 		memcpy(rpt->data, transfer->buffer, transfer->actual_length);
 		rpt->len = transfer->actual_length;
-		rpt->next = NULL;
-
-		pthread_mutex_lock(&dev->mutex);
+		rpt->timestamp = timestamp;
 
-		/* Attach the new report object to the end of the list. */
-		if (dev->input_reports == NULL) {
-			/* The list is empty. Put it at the root. */
-			dev->input_reports = rpt;
+		if (dev->num_input_reports++ == 0) {
+			/* The queue was empty. */
 			pthread_cond_signal(&dev->condition);
 		}
-		else {
-			/* Find the end of the list and attach. */
-			struct input_report *cur = dev->input_reports;
-			int num_queued = 0;
-			while (cur->next != NULL) {
-				cur = cur->next;
-				num_queued++;
-			}
-			cur->next = rpt;
-			
-			/* Pop one off if we've reached 30 in the queue. This
-			   way we don't grow forever if the user never reads
-			   anything from the device. */
-			if (num_queued > 30) {
-				return_data(dev, NULL, 0);
-			}			
-		}
 		pthread_mutex_unlock(&dev->mutex);
 	}
 	else if (transfer->status == LIBUSB_TRANSFER_CANCELLED) {
-		dev->shutdown_thread = 1;
+		transfer_done(dev);
 		return;
 	}
 	else if (transfer->status == LIBUSB_TRANSFER_NO_DEVICE) {
-		dev->shutdown_thread = 1;
+		report_disconnect(dev, timestamp);
+		transfer_done(dev);
 		return;
 	}
 	else if (transfer->status == LIBUSB_TRANSFER_TIMED_OUT) {
@@ -646,104 +1117,353 @@ static void read_callback(struct libusb_transfer *transfer)
 		LOG("Unknown transfer code: %d\n", transfer->status);
 	}
 	
-	/* Re-submit the transfer object. */
-	libusb_submit_transfer(transfer);
+	resubmit_transfer(transfer, timestamp);
 }
 
 
-static void *read_thread(void *param)
+static void *event_thread_main(void *param)
 {
-	hid_device *dev = param;
-	unsigned char *buf;
-	const size_t length = dev->input_ep_max_packet_size;
-
-	/* Set up the transfer object. */
-	buf = malloc(length);
-	dev->transfer = libusb_alloc_transfer(0);
-	libusb_fill_interrupt_transfer(dev->transfer,
-		dev->device_handle,
-		dev->input_endpoint,
-		buf,
-		length,
-		read_callback,
-		dev,
-		5000/*timeout*/);
-	
-	/* Make the first submission. Further submissions are made
-	   from inside read_callback() */
-	libusb_submit_transfer(dev->transfer);
-
-	// Notify the main thread that the read thread is up and running.
-	pthread_barrier_wait(&dev->barrier);
-	
-	/* Handle all the events. */
-	while (!dev->shutdown_thread) {
-		int res;
-		res = libusb_handle_events(NULL);
-		if (res < 0) {
+	/* Handle all the events, for every device. With no input timeouts
+	   set this only wakes up when a device has sent something. */
+	while (!event_thread_exit) {
+		struct timeval tv = { EVENT_LOOP_TIMEOUT, 0 };
+		int res = libusb_handle_events_timeout_completed(usb_context, &tv, NULL);
+		if (res < 0 && res != LIBUSB_ERROR_INTERRUPTED) {
 			/* There was an error. Break out of this loop. */
+			LOG("libusb_handle_events() failed: %d\n", res);
 			break;
 		}
 	}
 	
-	/* Cancel any transfer that may be pending. This call will fail
-	   if no transfers are pending, but that's OK. */
-	if (libusb_cancel_transfer(dev->transfer) == 0) {
-		/* The transfer was cancelled, so wait for its completion. */
-		libusb_handle_events(NULL);
+	return NULL;
+}
+
+/* Take a reference on the event thread, starting it if necessary.
+   Returns 0 on success or -1 if the thread could not be created. */
+static int event_thread_get(void)
+{
+	int res = 0;
+
+	pthread_mutex_lock(&event_thread_lock);
+	if (event_thread_users == 0) {
+		event_thread_exit = 0;
+		if (pthread_create(&event_thread, NULL, event_thread_main, NULL) != 0)
+			res = -1;
 	}
-	
-	/* Now that the read thread is stopping, Wake any threads which are
-	   waiting on data (in hid_read_timeout()). Do this under a mutex to
-	   make sure that a thread which is about to go to sleep waiting on
-	   the condition acutally will go to sleep before the condition is
-	   signaled. */
+	if (res == 0)
+		event_thread_users++;
+	pthread_mutex_unlock(&event_thread_lock);
+
+	return res;
+}
+
+/* Drop a reference on the event thread, stopping it when the last
+   device has been closed. */
+static void event_thread_put(void)
+{
+	pthread_mutex_lock(&event_thread_lock);
+	if (--event_thread_users == 0) {
+		event_thread_exit = 1;
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000105
+		libusb_interrupt_event_handler(usb_context);
+#endif
+		pthread_join(event_thread, NULL);
+	}
+	pthread_mutex_unlock(&event_thread_lock);
+}
+
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000102
+static int LIBUSB_CALL hotplug_event(libusb_context *ctx, libusb_device *device, libusb_hotplug_event event, void *user_data)
+{
+	struct hid_device_info *devs = NULL;
+
+	/* Only the descriptors libusb already has are read here, as the
+	   device can't be talked to from inside its hotplug callback. */
+	if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED) {
+		append_device_infos(device, 0x0, NULL, 0, HID_ENUMERATE_NO_STRINGS, &devs);
+		if (!devs)
+			return 0;
+	}
+
+	pthread_mutex_lock(&hotplug_lock);
+	if (hotplug_callback) {
+		hotplug_callback(devs? HID_HOTPLUG_ARRIVED: HID_HOTPLUG_LEFT,
+			devs, device, hotplug_user_data);
+		devs = NULL;
+	}
+	pthread_mutex_unlock(&hotplug_lock);
+
+	hid_free_enumeration(devs);
+	return 0;
+}
+#endif
+
+int HID_API_EXPORT hid_hotplug_register(unsigned short vendor_id, unsigned short product_id, hid_hotplug_callback callback, void *user_data)
+{
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000102
+	int res = -1;
+
+	if (hid_init() < 0 || !libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG))
+		return -1;
+
+	pthread_mutex_lock(&hotplug_setup_lock);
+	if (hotplug_registered)
+		goto unlock;
+
+	pthread_mutex_lock(&hotplug_lock);
+	hotplug_callback = callback;
+	hotplug_user_data = user_data;
+	pthread_mutex_unlock(&hotplug_lock);
+
+	/* Events are only delivered while something handles them. */
+	if (event_thread_get() < 0)
+		goto err;
+
+	/* Not under hotplug_lock, as the devices already present are
+	   reported from inside this call. */
+	res = libusb_hotplug_register_callback(usb_context,
+		LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED|LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+		LIBUSB_HOTPLUG_ENUMERATE,
+		vendor_id? vendor_id: LIBUSB_HOTPLUG_MATCH_ANY,
+		product_id? product_id: LIBUSB_HOTPLUG_MATCH_ANY,
+		LIBUSB_HOTPLUG_MATCH_ANY,
+		hotplug_event, NULL, &hotplug_handle);
+	if (res < 0) {
+		event_thread_put();
+		goto err;
+	}
+	hotplug_registered = 1;
+	pthread_mutex_unlock(&hotplug_setup_lock);
+
+	return 0;
+
+err:
+	pthread_mutex_lock(&hotplug_lock);
+	hotplug_callback = NULL;
+	pthread_mutex_unlock(&hotplug_lock);
+unlock:
+	pthread_mutex_unlock(&hotplug_setup_lock);
+	return -1;
+#else
+	return -1;
+#endif
+}
+
+void HID_API_EXPORT hid_hotplug_deregister(void)
+{
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000102
+	pthread_mutex_lock(&hotplug_setup_lock);
+	if (hotplug_registered) {
+		/* libusb holds its own lock while calling hotplug_event(),
+		   so hotplug_lock mustn't be held here. */
+		libusb_hotplug_deregister_callback(usb_context, hotplug_handle);
+
+		/* Wait for a callback already running to finish. */
+		pthread_mutex_lock(&hotplug_lock);
+		hotplug_callback = NULL;
+		pthread_mutex_unlock(&hotplug_lock);
+
+		event_thread_put();
+		hotplug_registered = 0;
+	}
+	pthread_mutex_unlock(&hotplug_setup_lock);
+#endif
+}
+
+/* Set up the device's transfer objects and make the first submissions.
+   Further submissions are made from inside read_callback(). Returns the
+   number of transfers submitted. */
+static int start_transfers(hid_device *dev, int count)
+{
+	const size_t length = dev->input_ep_max_packet_size;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		struct libusb_transfer *transfer = libusb_alloc_transfer(0);
+		unsigned char *buf = malloc(length);
+		if (!transfer || !buf) {
+			libusb_free_transfer(transfer);
+			free(buf);
+			break;
+		}
+		libusb_fill_interrupt_transfer(transfer,
+			dev->device_handle,
+			dev->input_endpoint,
+			buf,
+			length,
+			read_callback,
+			dev,
+			dev->input_timeout);
+		dev->transfers[dev->num_transfers++] = transfer;
+	}
+
+	/* The event thread may already be completing the first ones, so
+	   count each as active before it is submitted. */
 	pthread_mutex_lock(&dev->mutex);
-	pthread_cond_broadcast(&dev->condition);
+	for (i = 0; i < dev->num_transfers; i++) {
+		dev->transfers_active++;
+		if (libusb_submit_transfer(dev->transfers[i]) < 0) {
+			dev->transfers_active--;
+			break;
+		}
+	}
+	if (dev->transfers_active == 0)
+		dev->shutdown_thread = 1;
 	pthread_mutex_unlock(&dev->mutex);
 
-	/* The dev->transfer->buffer and dev->transfer objects are cleaned up
-	   in hid_close(). They are not cleaned up here because this thread
-	   could end either due to a disconnect or due to a user
-	   call to hid_close(). In both cases the objects can be safely
-	   cleaned up after the call to pthread_join() (in hid_close()), but
-	   since hid_close() calls libusb_cancel_transfer(), on these objects,
-	   they can not be cleaned up here. */
-	
-	return NULL;
+	return i;
 }
 
 
-hid_device * HID_API_EXPORT hid_open_path(const char *path)
+/* Open the HID interface numbered interface_num on usb_dev, claim it,
+   and start reading from it. Returns NULL on failure. */
+static hid_device *open_device(libusb_device *usb_dev, int interface_num, int num_input_transfers, int input_timeout)
 {
 	hid_device *dev = NULL;
+	struct libusb_device_descriptor desc;
+	struct libusb_config_descriptor *conf_desc = NULL;
+	const struct libusb_interface_descriptor *intf_desc = NULL;
+	int res;
+	int i,j,k;
+
+	if (num_input_transfers <= 0)
+		num_input_transfers = DEFAULT_INPUT_TRANSFERS;
+	if (num_input_transfers > MAX_INPUT_TRANSFERS)
+		num_input_transfers = MAX_INPUT_TRANSFERS;
+
+	libusb_get_device_descriptor(usb_dev, &desc);
+	if (libusb_get_active_config_descriptor(usb_dev, &conf_desc) < 0)
+		return NULL;
+
+	/* Find the interface's descriptor. */
+	for (j = 0; j < conf_desc->bNumInterfaces && !intf_desc; j++) {
+		const struct libusb_interface *intf = &conf_desc->interface[j];
+		for (k = 0; k < intf->num_altsetting; k++) {
+			if (intf->altsetting[k].bInterfaceClass == LIBUSB_CLASS_HID &&
+			    intf->altsetting[k].bInterfaceNumber == interface_num) {
+				intf_desc = &intf->altsetting[k];
+				break;
+			}
+		}
+	}
+	if (!intf_desc)
+		goto err_config;
 
 	dev = new_hid_device();
+	if (input_timeout > 0)
+		dev->input_timeout = input_timeout;
+
+	// OPEN HERE //
+	res = libusb_open(usb_dev, &dev->device_handle);
+	if (res < 0) {
+		LOG("can't open device\n");
+		goto err_free;
+	}
+	
+	/* Detach the kernel driver, but only if the
+	   device is managed by the kernel */
+	if (libusb_kernel_driver_active(dev->device_handle, interface_num) == 1) {
+		res = libusb_detach_kernel_driver(dev->device_handle, interface_num);
+		if (res < 0) {
+			LOG("Unable to detach Kernel Driver\n");
+			goto err_close;
+		}
+	}
+	
+	res = libusb_claim_interface(dev->device_handle, interface_num);
+	if (res < 0) {
+		LOG("can't claim interface %d: %d\n", interface_num, res);
+		goto err_close;
+	}
+
+	/* Store off the string descriptor indexes */
+	dev->manufacturer_index = desc.iManufacturer;
+	dev->product_index      = desc.iProduct;
+	dev->serial_index       = desc.iSerialNumber;
+
+	/* Store off the interface number */
+	dev->interface = interface_num;
+							
+	/* Find the INPUT and OUTPUT endpoints. An
+	   OUTPUT endpoint is not required. */
+	for (i = 0; i < intf_desc->bNumEndpoints; i++) {
+		const struct libusb_endpoint_descriptor *ep
+			= &intf_desc->endpoint[i];
+
+		/* Determine the type and direction of this
+		   endpoint. */
+		int is_interrupt =
+			(ep->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK)
+		      == LIBUSB_TRANSFER_TYPE_INTERRUPT;
+		int is_output = 
+			(ep->bEndpointAddress & LIBUSB_ENDPOINT_DIR_MASK)
+		      == LIBUSB_ENDPOINT_OUT;
+		int is_input = 
+			(ep->bEndpointAddress & LIBUSB_ENDPOINT_DIR_MASK)
+		      == LIBUSB_ENDPOINT_IN;
+
+		/* Decide whether to use it for intput or output. */
+		if (dev->input_endpoint == 0 &&
+		    is_interrupt && is_input) {
+			/* Use this endpoint for INPUT */
+			dev->input_endpoint = ep->bEndpointAddress;
+			dev->input_ep_max_packet_size = ep->wMaxPacketSize;
+		}
+		if (dev->output_endpoint == 0 &&
+		    is_interrupt && is_output) {
+			/* Use this endpoint for OUTPUT */
+			dev->output_endpoint = ep->bEndpointAddress;
+		}
+	}
+	
+	if (alloc_input_reports(dev) < 0 ||
+	    event_thread_get() < 0) {
+		LOG("can't start reading\n");
+		libusb_release_interface(dev->device_handle, dev->interface);
+		goto err_close;
+	}
+	start_transfers(dev, num_input_transfers);
+
+	libusb_free_config_descriptor(conf_desc);
+	return dev;
+
+err_close:
+	libusb_close(dev->device_handle);
+err_free:
+	free_hid_device(dev);
+err_config:
+	libusb_free_config_descriptor(conf_desc);
+	return NULL;
+}
+
+hid_device * HID_API_EXPORT hid_open_path(const char *path)
+{
+	return hid_open_path_ex(path, 0, 0);
+}
+
+hid_device * HID_API_EXPORT hid_open_path_ex(const char *path, int num_input_transfers, int input_timeout)
+{
+	hid_device *dev = NULL;
 
 	libusb_device **devs;
 	libusb_device *usb_dev;
 	ssize_t num_devs;
-	int res;
 	int d = 0;
-	int good_open = 0;
 	
-	setlocale(LC_ALL,"");
-	
-	if (!initialized) {
-		libusb_init(NULL);
-		initialized = 1;
-	}
+	if (hid_init() < 0)
+		return NULL;
 	
-	num_devs = libusb_get_device_list(NULL, &devs);
-	while ((usb_dev = devs[d++]) != NULL) {
-		struct libusb_device_descriptor desc;
+	num_devs = libusb_get_device_list(usb_context, &devs);
+	if (num_devs < 0)
+		return NULL;
+	while ((usb_dev = devs[d++]) != NULL && !dev) {
 		struct libusb_config_descriptor *conf_desc = NULL;
-		int i,j,k;
-		libusb_get_device_descriptor(usb_dev, &desc);
+		int interface_num = -1;
+		int j,k;
 
 		if (libusb_get_active_config_descriptor(usb_dev, &conf_desc) < 0)
 			continue;
-		for (j = 0; j < conf_desc->bNumInterfaces; j++) {
+		for (j = 0; j < conf_desc->bNumInterfaces && interface_num < 0; j++) {
 			const struct libusb_interface *intf = &conf_desc->interface[j];
 			for (k = 0; k < intf->num_altsetting; k++) {
 				const struct libusb_interface_descriptor *intf_desc;
@@ -752,103 +1472,33 @@ hid_device * HID_API_EXPORT hid_open_path(const char *path)
 					char *dev_path = make_path(usb_dev, intf_desc->bInterfaceNumber);
 					if (!strcmp(dev_path, path)) {
 						/* Matched Paths. Open this device */
-
-						// OPEN HERE //
-						res = libusb_open(usb_dev, &dev->device_handle);
-						if (res < 0) {
-							LOG("can't open device\n");
-							free(dev_path);
- 							break;
-						}
-						good_open = 1;
-						
-						/* Detach the kernel driver, but only if the
-						   device is managed by the kernel */
-						if (libusb_kernel_driver_active(dev->device_handle, intf_desc->bInterfaceNumber) == 1) {
-							res = libusb_detach_kernel_driver(dev->device_handle, intf_desc->bInterfaceNumber);
-							if (res < 0) {
-								libusb_close(dev->device_handle);
-								LOG("Unable to detach Kernel Driver\n");
-								free(dev_path);
-								good_open = 0;
-								break;
-							}
-						}
-						
-						res = libusb_claim_interface(dev->device_handle, intf_desc->bInterfaceNumber);
-						if (res < 0) {
-							LOG("can't claim interface %d: %d\n", intf_desc->bInterfaceNumber, res);
-							free(dev_path);
-							libusb_close(dev->device_handle);
-							good_open = 0;
-							break;
-						}
-
-						/* Store off the string descriptor indexes */
-						dev->manufacturer_index = desc.iManufacturer;
-						dev->product_index      = desc.iProduct;
-						dev->serial_index       = desc.iSerialNumber;
-
-						/* Store off the interface number */
-						dev->interface = intf_desc->bInterfaceNumber;
-												
-						/* Find the INPUT and OUTPUT endpoints. An
-						   OUTPUT endpoint is not required. */
-						for (i = 0; i < intf_desc->bNumEndpoints; i++) {
-							const struct libusb_endpoint_descriptor *ep
-								= &intf_desc->endpoint[i];
-
-							/* Determine the type and direction of this
-							   endpoint. */
-							int is_interrupt =
-								(ep->bmAttributes & LIBUSB_TRANSFER_TYPE_MASK)
-							      == LIBUSB_TRANSFER_TYPE_INTERRUPT;
-							int is_output = 
-								(ep->bEndpointAddress & LIBUSB_ENDPOINT_DIR_MASK)
-							      == LIBUSB_ENDPOINT_OUT;
-							int is_input = 
-								(ep->bEndpointAddress & LIBUSB_ENDPOINT_DIR_MASK)
-							      == LIBUSB_ENDPOINT_IN;
-
-							/* Decide whether to use it for intput or output. */
-							if (dev->input_endpoint == 0 &&
-							    is_interrupt && is_input) {
-								/* Use this endpoint for INPUT */
-								dev->input_endpoint = ep->bEndpointAddress;
-								dev->input_ep_max_packet_size = ep->wMaxPacketSize;
-							}
-							if (dev->output_endpoint == 0 &&
-							    is_interrupt && is_output) {
-								/* Use this endpoint for OUTPUT */
-								dev->output_endpoint = ep->bEndpointAddress;
-							}
-						}
-						
-						pthread_create(&dev->thread, NULL, read_thread, dev);
-						
-						// Wait here for the read thread to be initialized.
-						pthread_barrier_wait(&dev->barrier);
-						
+						interface_num = intf_desc->bInterfaceNumber;
 					}
 					free(dev_path);
+					if (interface_num >= 0)
+						break;
 				}
 			}
 		}
 		libusb_free_config_descriptor(conf_desc);
 
+		if (interface_num >= 0)
+			dev = open_device(usb_dev, interface_num, num_input_transfers, input_timeout);
 	}
 
 	libusb_free_device_list(devs, 1);
 	
-	// If we have a good handle, return it.
-	if (good_open) {
-		return dev;
-	}
-	else {
-		// Unable to open any devices.
-		free_hid_device(dev);
-		return NULL;
-	}
+	return dev;
+}
+
+hid_device * HID_API_EXPORT hid_open_info(const struct hid_device_info *info, int num_input_transfers, int input_timeout)
+{
+	/* The libusb_device from hid_enumerate() is still referenced, so
+	   the bus needn't be scanned for it again. */
+	if (info->device && hid_init() == 0)
+		return open_device(info->device, info->interface_number, num_input_transfers, input_timeout);
+
+	return hid_open_path_ex(info->path, num_input_transfers, input_timeout);
 }
 
 
@@ -902,19 +1552,134 @@ int HID_API_EXPORT hid_write(hid_device *dev, const unsigned char *data, size_t
 	}
 }
 
+/* State for one hid_write_async(), kept in the transfer's user_data. */
+struct write_request {
+	hid_device *dev;
+	int slot; /* index in dev->write_transfers */
+	int skipped_report_id;
+	hid_write_callback callback;
+	void *user_data;
+};
+
+static void write_callback(struct libusb_transfer *transfer)
+{
+	struct write_request *req = transfer->user_data;
+	hid_device *dev = req->dev;
+	int res = -1;
+
+	if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+		res = transfer->actual_length;
+		if (req->skipped_report_id)
+			res++;
+	}
+
+	/* Free the slot first, so that the callback can queue the next
+	   write in its place. */
+	pthread_mutex_lock(&dev->mutex);
+	dev->write_transfers[req->slot] = NULL;
+	pthread_mutex_unlock(&dev->mutex);
+
+	if (req->callback)
+		req->callback(dev, res, req->user_data);
+
+	/* Let hid_close() know once the last one is done. */
+	pthread_mutex_lock(&dev->mutex);
+	dev->writes_active--;
+	pthread_cond_broadcast(&dev->condition);
+	pthread_mutex_unlock(&dev->mutex);
+
+	free(transfer->buffer);
+	libusb_free_transfer(transfer);
+	free(req);
+}
+
+int HID_API_EXPORT hid_write_async(hid_device *dev, const unsigned char *data, size_t length, hid_write_callback callback, void *user_data)
+{
+	int res = -1;
+	int report_number;
+	int skipped_report_id = 0;
+	int slot;
+
+	if (length == 0)
+		return -1;
+	report_number = data[0];
+	if (report_number == 0x0) {
+		/* Nothing left to send without the report ID. */
+		if (length <= 1)
+			return -1;
+		data++;
+		length--;
+		skipped_report_id = 1;
+	}
+
+	struct libusb_transfer *transfer = libusb_alloc_transfer(0);
+	struct write_request *req = malloc(sizeof(*req));
+	unsigned char *buf = malloc(LIBUSB_CONTROL_SETUP_SIZE + length);
+	if (!transfer || !req || !buf)
+		goto err;
+
+	req->dev = dev;
+	req->skipped_report_id = skipped_report_id;
+	req->callback = callback;
+	req->user_data = user_data;
+
+	if (dev->output_endpoint <= 0) {
+		/* No interrput out endpoint. Use the Control Endpoint */
+		libusb_fill_control_setup(buf,
+			LIBUSB_REQUEST_TYPE_CLASS|LIBUSB_RECIPIENT_INTERFACE|LIBUSB_ENDPOINT_OUT,
+			0x09/*HID Set_Report*/,
+			(2/*HID output*/ << 8) | report_number,
+			dev->interface,
+			length);
+		memcpy(buf + LIBUSB_CONTROL_SETUP_SIZE, data, length);
+		libusb_fill_control_transfer(transfer, dev->device_handle,
+			buf, write_callback, req, 1000/*timeout millis*/);
+	}
+	else {
+		/* Use the interrupt out endpoint */
+		memcpy(buf, data, length);
+		libusb_fill_interrupt_transfer(transfer, dev->device_handle,
+			dev->output_endpoint, buf, length,
+			write_callback, req, 1000/*timeout millis*/);
+	}
+
+	pthread_mutex_lock(&dev->mutex);
+	for (slot = 0; slot < MAX_PENDING_WRITES; slot++) {
+		if (!dev->write_transfers[slot])
+			break;
+	}
+	if (slot < MAX_PENDING_WRITES && !dev->shutdown_thread) {
+		req->slot = slot;
+		res = libusb_submit_transfer(transfer);
+		if (res == 0) {
+			dev->write_transfers[slot] = transfer;
+			dev->writes_active++;
+		}
+	}
+	pthread_mutex_unlock(&dev->mutex);
+
+	if (res == 0)
+		return 0;
+
+err:
+	free(buf);
+	free(req);
+	libusb_free_transfer(transfer);
+	return -1;
+}
+
 /* Helper function, to simplify hid_read().
    This should be called with dev->mutex locked. */
 static int return_data(hid_device *dev, unsigned char *data, size_t length)
 {
-	/* Copy the data out of the linked list item (rpt) into the
-	   return buffer (data), and delete the liked list item. */
-	struct input_report *rpt = dev->input_reports;
+	/* Copy the data out of the first report in the queue (rpt) into
+	   the return buffer (data), and remove it from the queue. */
+	struct input_report *rpt = &dev->input_reports[dev->first_input_report];
 	size_t len = (length < rpt->len)? length: rpt->len;
 	if (len > 0)
 		memcpy(data, rpt->data, len);
-	dev->input_reports = rpt->next;
-	free(rpt->data);
-	free(rpt);
+	dev->first_input_report = (dev->first_input_report + 1) & (MAX_QUEUED_REPORTS-1);
+	dev->num_input_reports--;
 	return len;
 }
 
@@ -940,7 +1705,7 @@ int HID_API_EXPORT hid_read_timeout(hid_device *dev, unsigned char *data, size_t
 	pthread_cleanup_push(&cleanup_mutex, dev);
 
 	/* There's an input report queued up. Return it. */
-	if (dev->input_reports) {
+	if (dev->num_input_reports) {
 		/* Return the first one */
 		bytes_read = return_data(dev, data, length);
 		goto ret;
@@ -955,10 +1720,10 @@ int HID_API_EXPORT hid_read_timeout(hid_device *dev, unsigned char *data, size_t
 	
 	if (milliseconds == -1) {
 		/* Blocking */
-		while (!dev->input_reports && !dev->shutdown_thread) {
+		while (!dev->num_input_reports && !dev->shutdown_thread) {
 			pthread_cond_wait(&dev->condition, &dev->mutex);
 		}
-		if (dev->input_reports) {
+		if (dev->num_input_reports) {
 			bytes_read = return_data(dev, data, length);
 		}
 	}
@@ -974,10 +1739,10 @@ int HID_API_EXPORT hid_read_timeout(hid_device *dev, unsigned char *data, size_t
 			ts.tv_nsec -= 1000000000L;
 		}
 		
-		while (!dev->input_reports && !dev->shutdown_thread) {
+		while (!dev->num_input_reports && !dev->shutdown_thread) {
 			res = pthread_cond_timedwait(&dev->condition, &dev->mutex, &ts);
 			if (res == 0) {
-				if (dev->input_reports) {
+				if (dev->num_input_reports) {
 					bytes_read = return_data(dev, data, length);
 					break;
 				}
@@ -1022,6 +1787,29 @@ int HID_API_EXPORT hid_set_nonblocking(hid_device *dev, int nonblock)
 	return 0;
 }
 
+void HID_API_EXPORT hid_set_input_callback(hid_device *dev, hid_input_callback callback, void *user_data)
+{
+	pthread_mutex_lock(&dev->mutex);
+
+	/* Pass on anything which was queued before the callback was set, so
+	   that it arrives ahead of the reports read_callback() delivers. */
+	while (callback && dev->num_input_reports) {
+		struct input_report *rpt = &dev->input_reports[dev->first_input_report];
+		callback(dev, rpt->data, rpt->len, rpt->timestamp, user_data);
+		dev->first_input_report = (dev->first_input_report + 1) & (MAX_QUEUED_REPORTS-1);
+		dev->num_input_reports--;
+	}
+
+	/* Nothing more is coming if the device has already gone. */
+	if (callback && dev->disconnected)
+		callback(dev, NULL, -1, monotonic_ns(), user_data);
+
+	dev->input_callback_data = user_data;
+	atomic_store_explicit(&dev->input_callback, callback, memory_order_release);
+
+	pthread_mutex_unlock(&dev->mutex);
+}
+
 
 int HID_API_EXPORT hid_send_feature_report(hid_device *dev, const unsigned char *data, size_t length)
 {
@@ -1083,22 +1871,176 @@ int HID_API_EXPORT hid_get_feature_report(hid_device *dev, unsigned char *data,
 	return res;
 }
 
+/* State for one hid_send_feature_report_async() or
+   hid_get_feature_report_async(), kept in the transfer's user_data. */
+struct feature_request {
+	hid_device *dev;
+	int slot; /* index in dev->feature_transfers */
+	int skipped_report_id;
+	hid_feature_callback callback;
+	void *user_data;
+};
+
+static void feature_callback(struct libusb_transfer *transfer)
+{
+	struct feature_request *req = transfer->user_data;
+	hid_device *dev = req->dev;
+	unsigned char *data = NULL;
+	int res = -1;
+
+	if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+		res = transfer->actual_length;
+		if (transfer->buffer[0] & LIBUSB_ENDPOINT_IN) {
+			data = libusb_control_transfer_get_data(transfer);
+			if (req->skipped_report_id) {
+				/* Put the report ID back in front, in the
+				   byte left spare for it at the end. */
+				memmove(data + 1, data, res);
+				data[0] = 0x0;
+			}
+		}
+		if (req->skipped_report_id)
+			res++;
+	}
+
+	/* Free the slot first, so that the callback can queue the next
+	   request in its place. */
+	pthread_mutex_lock(&dev->mutex);
+	dev->feature_transfers[req->slot] = NULL;
+	pthread_mutex_unlock(&dev->mutex);
+
+	if (req->callback)
+		req->callback(dev, data, res, req->user_data);
+
+	/* Let hid_close() know once the last one is done. */
+	pthread_mutex_lock(&dev->mutex);
+	dev->features_active--;
+	pthread_cond_broadcast(&dev->condition);
+	pthread_mutex_unlock(&dev->mutex);
+
+	free(transfer->buffer);
+	libusb_free_transfer(transfer);
+	free(req);
+}
+
+/* Submit a feature report Get_Report or Set_Report control transfer.
+   For a set, data holds the report without its ID; for a get it is
+   NULL. */
+static int submit_feature_request(hid_device *dev, int get, int report_number, const unsigned char *data, size_t length, int skipped_report_id, hid_feature_callback callback, void *user_data)
+{
+	int res = -1;
+	int slot;
+
+	struct libusb_transfer *transfer = libusb_alloc_transfer(0);
+	struct feature_request *req = malloc(sizeof(*req));
+	/* One byte spare, for feature_callback() to put the report ID
+	   back. */
+	unsigned char *buf = malloc(LIBUSB_CONTROL_SETUP_SIZE + length + 1);
+	if (!transfer || !req || !buf)
+		goto err;
+
+	req->dev = dev;
+	req->skipped_report_id = skipped_report_id;
+	req->callback = callback;
+	req->user_data = user_data;
+
+	libusb_fill_control_setup(buf,
+		LIBUSB_REQUEST_TYPE_CLASS|LIBUSB_RECIPIENT_INTERFACE|
+			(get? LIBUSB_ENDPOINT_IN: LIBUSB_ENDPOINT_OUT),
+		get? 0x01/*HID get_report*/: 0x09/*HID set_report*/,
+		(3/*HID feature*/ << 8) | report_number,
+		dev->interface,
+		length);
+	if (data)
+		memcpy(buf + LIBUSB_CONTROL_SETUP_SIZE, data, length);
+	libusb_fill_control_transfer(transfer, dev->device_handle,
+		buf, feature_callback, req, 1000/*timeout millis*/);
+
+	pthread_mutex_lock(&dev->mutex);
+	for (slot = 0; slot < MAX_PENDING_FEATURE_REQUESTS; slot++) {
+		if (!dev->feature_transfers[slot])
+			break;
+	}
+	if (slot < MAX_PENDING_FEATURE_REQUESTS && !dev->shutdown_thread) {
+		req->slot = slot;
+		res = libusb_submit_transfer(transfer);
+		if (res == 0) {
+			dev->feature_transfers[slot] = transfer;
+			dev->features_active++;
+		}
+	}
+	pthread_mutex_unlock(&dev->mutex);
+
+	if (res == 0)
+		return 0;
+
+err:
+	free(buf);
+	free(req);
+	libusb_free_transfer(transfer);
+	return -1;
+}
+
+int HID_API_EXPORT hid_send_feature_report_async(hid_device *dev, const unsigned char *data, size_t length, hid_feature_callback callback, void *user_data)
+{
+	int skipped_report_id = 0;
+	int report_number = data[0];
+
+	if (report_number == 0x0) {
+		data++;
+		length--;
+		skipped_report_id = 1;
+	}
+
+	return submit_feature_request(dev, 0, report_number, data, length,
+		skipped_report_id, callback, user_data);
+}
+
+int HID_API_EXPORT hid_get_feature_report_async(hid_device *dev, unsigned char report_number, size_t length, hid_feature_callback callback, void *user_data)
+{
+	int skipped_report_id = 0;
+
+	if (report_number == 0x0) {
+		/* The device won't send the report ID, so don't ask for a
+		   byte for it. */
+		length--;
+		skipped_report_id = 1;
+	}
+
+	return submit_feature_request(dev, 1, report_number, NULL, length,
+		skipped_report_id, callback, user_data);
+}
+
 
 void HID_API_EXPORT hid_close(hid_device *dev)
 {
+	int i;
+
 	if (!dev)
 		return;
 	
-	/* Cause read_thread() to stop. */
+	/* Stop the transfers being resubmitted, cancel them, and wait for
+	   the event thread to finish with them. Cancelling one which is
+	   not submitted just fails. */
+	pthread_mutex_lock(&dev->mutex);
 	dev->shutdown_thread = 1;
-	libusb_cancel_transfer(dev->transfer);
-
-	/* Wait for read_thread() to end. */
-	pthread_join(dev->thread, NULL);
+	for (i = 0; i < dev->num_transfers && dev->transfers_active; i++)
+		libusb_cancel_transfer(dev->transfers[i]);
+	while (dev->transfers_active)
+		pthread_cond_wait(&dev->condition, &dev->mutex);
+
+	/* Let queued writes and feature requests finish, so that the last
+	   thing the application sent reaches the device. Each has a
+	   timeout, so this is bounded. */
+	while (dev->writes_active || dev->features_active)
+		pthread_cond_wait(&dev->condition, &dev->mutex);
+	pthread_mutex_unlock(&dev->mutex);
 	
-	/* Clean up the Transfer objects allocated in read_thread(). */
-	free(dev->transfer->buffer);
-	libusb_free_transfer(dev->transfer);
+	/* Clean up the Transfer objects allocated in start_transfers(). */
+	for (i = 0; i < dev->num_transfers; i++) {
+		free(dev->transfers[i]->buffer);
+		libusb_free_transfer(dev->transfers[i]);
+	}
 	
 	/* release the interface */
 	libusb_release_interface(dev->device_handle, dev->interface);
@@ -1106,45 +2048,55 @@ void HID_API_EXPORT hid_close(hid_device *dev)
 	/* Close the handle */
 	libusb_close(dev->device_handle);
 	
-	/* Clear out the queue of received reports. */
-	pthread_mutex_lock(&dev->mutex);
-	while (dev->input_reports) {
-		return_data(dev, NULL, 0);
-	}
-	pthread_mutex_unlock(&dev->mutex);
+	event_thread_put();
 	
 	free_hid_device(dev);
 }
 
 
+/* Copy str, from get_device_string() or get_usb_string(), to the
+   caller's buffer and free it. */
+static int return_string(wchar_t *str, wchar_t *string, size_t maxlen)
+{
+	if (str) {
+		wcsncpy(string, str, maxlen);
+		string[maxlen-1] = L'\0';
+		free(str);
+		return 0;
+	}
+	else
+		return -1;
+}
+
 int HID_API_EXPORT_CALL hid_get_manufacturer_string(hid_device *dev, wchar_t *string, size_t maxlen)
 {
-	return hid_get_indexed_string(dev, dev->manufacturer_index, string, maxlen);
+	return return_string(get_device_string(libusb_get_device(dev->device_handle), dev->device_handle, STRING_MANUFACTURER), string, maxlen);
 }
 
 int HID_API_EXPORT_CALL hid_get_product_string(hid_device *dev, wchar_t *string, size_t maxlen)
 {
-	return hid_get_indexed_string(dev, dev->product_index, string, maxlen);
+	return return_string(get_device_string(libusb_get_device(dev->device_handle), dev->device_handle, STRING_PRODUCT), string, maxlen);
 }
 
 int HID_API_EXPORT_CALL hid_get_serial_number_string(hid_device *dev, wchar_t *string, size_t maxlen)
 {
-	return hid_get_indexed_string(dev, dev->serial_index, string, maxlen);
+	return return_string(get_device_string(libusb_get_device(dev->device_handle), dev->device_handle, STRING_SERIAL), string, maxlen);
 }
 
 int HID_API_EXPORT_CALL hid_get_indexed_string(hid_device *dev, int string_index, wchar_t *string, size_t maxlen)
 {
-	wchar_t *str;
-
-	str = get_usb_string(dev->device_handle, string_index);
-	if (str) {
-		wcsncpy(string, str, maxlen);
-		string[maxlen-1] = L'\0';
-		free(str);
-		return 0;
+	/* The ones named in the device descriptor are cached. */
+	if (string_index > 0) {
+		if (string_index == dev->manufacturer_index)
+			return hid_get_manufacturer_string(dev, string, maxlen);
+		if (string_index == dev->product_index)
+			return hid_get_product_string(dev, string, maxlen);
+		if (string_index == dev->serial_index)
+			return hid_get_serial_number_string(dev, string, maxlen);
 	}
-	else
-		return -1;
+
+	return return_string(get_usb_string(dev->device_handle,
+		get_cached_language(dev->device_handle), string_index), string, maxlen);
 }
 
 
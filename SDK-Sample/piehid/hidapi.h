@@ -28,6 +28,7 @@
 #define HIDAPI_H__
 
 #include <wchar.h>
+#include <stdint.h>
 
 #ifdef _WIN32
       #define HID_API_EXPORT __declspec(dllexport)
@@ -73,12 +74,46 @@ extern "C" {
 			    in all cases, and valid on the Windows implementation
 			    only if the device contains more than one interface. */
 			int interface_number;
+			/** The backend's own reference to the device, which lets
+			    hid_open_info() open it without searching for the
+			    path. Released by hid_free_enumeration(). */
+			void *device;
 
 			/** Pointer to the next device */
 			struct hid_device_info *next;
 		};
 
 
+		/** @brief Initialize the HIDAPI library.
+
+			This function sets up the library's own USB context. It
+			does not need to be called, as hid_enumerate() and the
+			hid_open*() functions call it themselves, but it may be, to
+			find out early whether the library can work at all. It is
+			safe to call from several threads at once, and more than
+			once.
+
+			@ingroup API
+
+			@returns
+				This function returns 0 on success and -1 on error.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_init(void);
+
+		/** @brief Finalize the HIDAPI library.
+
+			This function frees the library's USB context. Every device
+			must have been closed first. The library may be used again
+			afterwards, which sets it up anew.
+
+			@ingroup API
+
+			@returns
+				This function returns 0 on success and -1 on error.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_exit(void);
+
+
 		/** @brief Enumerate the HID Devices.
 
 			This function returns a linked list of all the HID devices
@@ -100,6 +135,52 @@ extern "C" {
 		*/
 		struct hid_device_info HID_API_EXPORT * HID_API_CALL hid_enumerate(unsigned short vendor_id, unsigned short product_id);
 
+		/** Flag for hid_enumerate_ex(): leave the manufacturer, product
+		    and serial number strings NULL. */
+		#define HID_ENUMERATE_NO_STRINGS 0x1
+
+		/** @brief Enumerate the HID Devices, with options.
+
+			Non-standard extension. As hid_enumerate(), with @p flags
+			to leave out what isn't needed. Reading a device's strings
+			means talking to it, so an application which doesn't show
+			them can enumerate faster with #HID_ENUMERATE_NO_STRINGS,
+			and still get them once a device is open from
+			hid_get_manufacturer_string() and the like.
+
+			@ingroup API
+			@param vendor_id As for hid_enumerate()
+			@param product_id As for hid_enumerate()
+			@param flags Zero or more HID_ENUMERATE_* flags, ORed
+				together.
+
+		    @returns
+		    	As for hid_enumerate().
+		*/
+		struct hid_device_info HID_API_EXPORT * HID_API_CALL hid_enumerate_ex(unsigned short vendor_id, unsigned short product_id, int flags);
+
+		/** @brief Enumerate the HID Devices of one vendor.
+
+			Non-standard extension. As hid_enumerate_ex(), but for any
+			of a list of products. Devices are checked against the
+			filter before anything else is read from them, so the time
+			taken depends on the number of matching devices rather than
+			on everything plugged in.
+
+			@ingroup API
+			@param vendor_id The Vendor ID (VID) of the devices to
+				enumerate, or 0 for any.
+			@param product_ids The Product IDs (PIDs) of the devices to
+				enumerate. May be NULL if @p num_product_ids is 0.
+			@param num_product_ids The number of entries in @p
+				product_ids, or 0 for any product.
+			@param flags As for hid_enumerate_ex().
+
+		    @returns
+		    	As for hid_enumerate().
+		*/
+		struct hid_device_info HID_API_EXPORT * HID_API_CALL hid_enumerate_filtered(unsigned short vendor_id, const unsigned short *product_ids, size_t num_product_ids, int flags);
+
 		/** @brief Free an enumeration Linked List
 
 		    This function frees a linked list created by hid_enumerate().
@@ -110,6 +191,51 @@ extern "C" {
 		*/
 		void  HID_API_EXPORT HID_API_CALL hid_free_enumeration(struct hid_device_info *devs);
 
+		/** Events for a hid_hotplug_callback. */
+		#define HID_HOTPLUG_ARRIVED 1
+		#define HID_HOTPLUG_LEFT 2
+
+		/** Called by hid_hotplug_register() when a device comes or goes.
+		    For #HID_HOTPLUG_ARRIVED, @p devs lists its HID interfaces as
+		    hid_enumerate_ex() would with #HID_ENUMERATE_NO_STRINGS, and
+		    belongs to the callback, which must free it with
+		    hid_free_enumeration(). For #HID_HOTPLUG_LEFT @p devs is NULL.
+		    Either way @p device identifies the device, as the
+		    hid_device_info::device of its interfaces. */
+		typedef void (HID_API_CALL *hid_hotplug_callback)(int event, struct hid_device_info *devs, void *device, void *user_data);
+
+		/** @brief Be told when HID devices are plugged in or removed.
+
+			Non-standard extension. @p callback is called at once for
+			each matching device already present, then whenever one
+			arrives or leaves, on the thread handling USB events. It
+			must not block, nor open or close devices. Only one
+			callback may be registered at a time.
+
+			@ingroup API
+			@param vendor_id The Vendor ID (VID) of the devices to
+				report, or 0 for any.
+			@param product_id The Product ID (PID) of the devices to
+				report, or 0 for any.
+			@param callback Called for each arrival and departure.
+			@param user_data Passed to @p callback unchanged.
+
+			@returns
+				This function returns 0 on success and -1 on error,
+				including when the platform can't report hotplug
+				events, in which case hid_enumerate() must be polled.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_hotplug_register(unsigned short vendor_id, unsigned short product_id, hid_hotplug_callback callback, void *user_data);
+
+		/** @brief Stop the callback set by hid_hotplug_register().
+
+			Once this returns the callback is not running and won't be
+			called again. hid_exit() does this itself.
+
+			@ingroup API
+		*/
+		void HID_API_EXPORT HID_API_CALL hid_hotplug_deregister(void);
+
 		/** @brief Open a HID device using a Vendor ID (VID), Product ID
 			(PID) and optionally a serial number.
 
@@ -143,6 +269,50 @@ extern "C" {
 		*/
 		HID_API_EXPORT hid_device * HID_API_CALL hid_open_path(const char *path);
 
+		/** @brief Open a HID device by its path name, choosing how many
+			Input transfers to keep queued.
+
+			Non-standard extension. As hid_open_path(), which keeps a
+			default number of transfers queued. More transfers let the
+			device keep sending reports while earlier ones are being
+			handled, at the cost of a buffer each.
+
+			By default the transfers never time out, so an idle device
+			costs nothing. With a timeout each transfer is resubmitted
+			whenever it expires without a report.
+
+			@ingroup API
+			@param path The path name of the device to open
+			@param num_input_transfers The number of interrupt IN
+				transfers to keep submitted, or 0 for the default.
+			@param input_timeout How long each transfer may wait for a
+				report, in milliseconds, or 0 to wait forever.
+
+			@returns
+				This function returns a pointer to a #hid_device object on
+				success or NULL on failure.
+		*/
+		HID_API_EXPORT hid_device * HID_API_CALL hid_open_path_ex(const char *path, int num_input_transfers, int input_timeout);
+
+		/** @brief Open a HID device from an enumeration entry.
+
+			Non-standard extension. As hid_open_path_ex(), but the
+			device is opened straight from what hid_enumerate() found,
+			rather than by searching every device on the bus for one
+			with the same path. The list @p info came from must not
+			have been freed.
+
+			@ingroup API
+			@param info The entry from hid_enumerate() to open
+			@param num_input_transfers As for hid_open_path_ex()
+			@param input_timeout As for hid_open_path_ex()
+
+			@returns
+				This function returns a pointer to a #hid_device object on
+				success or NULL on failure.
+		*/
+		HID_API_EXPORT hid_device * HID_API_CALL hid_open_info(const struct hid_device_info *info, int num_input_transfers, int input_timeout);
+
 		/** @brief Write an Output report to a HID device.
 
 			The first byte of @p data[] must contain the Report ID. For
@@ -171,6 +341,33 @@ extern "C" {
 		*/
 		int  HID_API_EXPORT HID_API_CALL hid_write(hid_device *device, const unsigned char *data, size_t length);
 
+		/** Completion callback for hid_write_async(). */
+		typedef void (HID_API_CALL *hid_write_callback)(hid_device *device, int result, void *user_data);
+
+		/** @brief Queue an Output report to be written to a HID device.
+
+			Non-standard extension. As hid_write(), but returns as soon
+			as the report has been copied and queued. Reports are sent
+			in the order they are queued. Up to 16 may be outstanding
+			on a device at once. hid_close() waits for outstanding
+			writes to complete.
+
+			@ingroup API
+			@param device A device handle returned from hid_open().
+			@param data The data to send, including the report number as
+				the first byte.
+			@param length The length in bytes of the data to send.
+			@param callback Called on the thread handling USB events when
+				the write completes, with what hid_write() would have
+				returned as @p result. It must not block. May be NULL.
+			@param user_data Passed to @p callback unchanged.
+
+			@returns
+				This function returns 0 if the report was queued, or -1
+				on error, including when too many writes are outstanding.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_write_async(hid_device *device, const unsigned char *data, size_t length, hid_write_callback callback, void *user_data);
+
 		/** @brief Read an Input report from a HID device with timeout.
 
 			Input reports are returned
@@ -230,6 +427,29 @@ extern "C" {
 		*/
 		int  HID_API_EXPORT HID_API_CALL hid_set_nonblocking(hid_device *device, int nonblock);
 
+		/** Input report callback for hid_set_input_callback(). */
+		typedef void (HID_API_CALL *hid_input_callback)(hid_device *device, const unsigned char *data, int length, uint64_t timestamp, void *user_data);
+
+		/** @brief Deliver Input reports to a callback instead of queueing them.
+
+			Non-standard extension. Once a callback is set, each Input
+			report is passed to it directly from the USB transfer
+			completion, on the thread handling USB events, and is not
+			available from hid_read(). Reports which were already queued
+			are passed to the callback before this function returns. The
+			callback must not block. A @p length of -1 means the device
+			has gone away and no more reports will follow. @p timestamp
+			is the CLOCK_MONOTONIC time, in nanoseconds, at which the
+			report's transfer completed.
+
+			@ingroup API
+			@param device A device handle returned from hid_open().
+			@param callback The function to call, or NULL to go back to
+				queueing reports for hid_read().
+			@param user_data Passed to @p callback unchanged.
+		*/
+		void HID_API_EXPORT HID_API_CALL hid_set_input_callback(hid_device *device, hid_input_callback callback, void *user_data);
+
 		/** @brief Send a Feature report to the device.
 
 			Feature reports are sent over the Control endpoint as a
@@ -279,6 +499,63 @@ extern "C" {
 		*/
 		int HID_API_EXPORT HID_API_CALL hid_get_feature_report(hid_device *device, unsigned char *data, size_t length);
 
+		/** Completion callback for hid_send_feature_report_async() and
+		    hid_get_feature_report_async(). @p data is the report read,
+		    starting with its ID, for a successful get and NULL
+		    otherwise; it is only valid during the call. */
+		typedef void (HID_API_CALL *hid_feature_callback)(hid_device *device, const unsigned char *data, int result, void *user_data);
+
+		/** @brief Queue a feature report to be sent to a HID device.
+
+			Non-standard extension. As hid_send_feature_report(), but
+			returns as soon as the report has been copied and queued.
+			Up to 16 feature requests, sets and gets together, may be
+			outstanding on a device at once, and any number of devices
+			may have them outstanding. hid_close() waits for them to
+			complete.
+
+			@ingroup API
+			@param device A device handle returned from hid_open().
+			@param data As for hid_send_feature_report().
+			@param length As for hid_send_feature_report().
+			@param callback Called on the thread handling USB events when
+				the request completes, with what hid_send_feature_report()
+				would have returned as @p result. It must not block. May
+				be NULL.
+			@param user_data Passed to @p callback unchanged.
+
+			@returns
+				This function returns 0 if the report was queued, or -1
+				on error, including when too many requests are
+				outstanding.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_send_feature_report_async(hid_device *device, const unsigned char *data, size_t length, hid_feature_callback callback, void *user_data);
+
+		/** @brief Queue a request for a feature report from a HID device.
+
+			Non-standard extension. As hid_get_feature_report(), but
+			returns once the request has been queued, and the report is
+			passed to @p callback. The same limits apply as for
+			hid_send_feature_report_async().
+
+			@ingroup API
+			@param device A device handle returned from hid_open().
+			@param report_number The Report ID of the report to read.
+			@param length The number of bytes to read, including an
+				extra byte for the report ID.
+			@param callback Called on the thread handling USB events when
+				the request completes, with the report and what
+				hid_get_feature_report() would have returned as @p
+				result. It must not block. May be NULL.
+			@param user_data Passed to @p callback unchanged.
+
+			@returns
+				This function returns 0 if the request was queued, or -1
+				on error, including when too many requests are
+				outstanding.
+		*/
+		int HID_API_EXPORT HID_API_CALL hid_get_feature_report_async(hid_device *device, unsigned char report_number, size_t length, hid_feature_callback callback, void *user_data);
+
 		/** @brief Close a HID device.
 
 			@ingroup API